@@ -21,8 +21,8 @@ namespace psdimpl
 
 	struct ChannelInfo
 	{
+		// Channel lengths depend on the file format, so are set by PSDLayout.
 		int16_t id{};
-		uint32_t length{};
 	};
 
 	struct PascalString
@@ -186,8 +186,9 @@ namespace psdimpl
 
 	struct Header
 	{
+		uint32_t length() const;
+		// The version depends on the file format, so is set by PSDLayout.
 		const std::string file_signature{ "8BPS" };
-		const uint16_t version{ 1 };
 		const std::vector<uint8_t> reserved{ 0, 0, 0, 0, 0, 0 };
 		uint16_t channel_count{ 3 };
 		uint32_t height{};
@@ -199,6 +200,7 @@ namespace psdimpl
 	struct ColourModeData
 	{
 		// Only indexed and duotone colour modes have colour mode data.
+		uint32_t length() const;
 		uint32_t colour_mode_data_length{ 0 };
 	};
 
@@ -247,18 +249,33 @@ namespace psdimpl
 		uint8_t padding{ 0 };
 	};
 
+	/* Only written when the merged image is left out, to tell readers to 
+	composite the layers themselves. */
+	struct VersionInfo : public ImageResourceBlock
+	{
+		uint16_t uid{ 1057 };
+		uint32_t length() const;
+		uint32_t version{ 1 };
+		uint8_t has_real_merged_data{ 1 };
+		// Stored as length prefixed UTF-16.
+		std::string writer_name{ "Adobe Photoshop" };
+		std::string reader_name{ "Adobe Photoshop" };
+		uint32_t file_version{ 1 };
+		uint8_t padding{ 0 };
+	};
+
 	struct ImageResources
 	{
 		uint32_t length() const;
 		ResolutionInfo resolution{};
 		ICCProfile icc_profile{};
 		GridAndGuides grid_and_guides{};
+		VersionInfo version_info{};
 	};
 
 	struct LayerAndMaskInfo
 	{
-		uint32_t layer_and_mask_info_length() const;
-		uint32_t layer_info_length() const;
+		// Section lengths are calculated by PSDLayout.
 		uint16_t layer_count() const;
 		std::vector<LayerRecord> layer_records{};
 		std::vector<std::unique_ptr<PSDImage>> layer_image_data{};
@@ -278,6 +295,7 @@ namespace psdimpl
 		ImageResources image_resources{};
 		LayerAndMaskInfo layer_and_mask_info{};
 		PSDRawImage image_data{};
+		psdw::PSDFormat format{ psdw::PSDFormat::Auto };
 	};
 }
 
@@ -0,0 +1,54 @@
+// Copyright (c) 2024 Dan Kemp. All rights reserved.
+// This source code is licensed under the MIT license found in the 
+// LICENSE file in the root directory of this source tree.
+
+#ifndef PSDENCODER_H
+#define PSDENCODER_H
+
+#include "psdocument.hpp"
+#include "psdtypes.hpp"
+
+#include <cstdint>
+#include <cstddef>
+
+namespace psdw
+{
+	/* Produces an encoded document a chunk at a time, at the caller's pace.
+	Useful where a save must not block, such as on an event loop. */
+	class DllExport PSDEncoder
+	{
+	public:
+		/* Flattens psd, then plans the document. The merged image's row 
+		lengths come first in the file, so it is packed once here to measure 
+		it, which blocks for as long as compressing it would. Only the lengths
+		are kept, and rows are packed again as next_chunk reaches them, so 
+		memory doesn't grow with the merged image. psd must outlive the 
+		encoder and must not be modified while it is in use. If psd has been 
+		released by save_async, status() is InvalidArgument. */
+		PSDEncoder(PSDocument& psd);
+
+		~PSDEncoder();
+		PSDEncoder(PSDEncoder&&) noexcept;
+		PSDEncoder(const PSDEncoder&) = delete;
+		PSDEncoder& operator=(PSDEncoder&&) noexcept;
+		PSDEncoder& operator=(const PSDEncoder&) = delete;
+
+		/* Fill buffer with up to size bytes of the next part of the file. 
+		Returns the number of bytes written, which is only less than size at 
+		the end of the file. */
+		size_t next_chunk(unsigned char* buffer, size_t size);
+
+		bool done() const;
+
+		// Total length of the encoded document in bytes.
+		uint64_t size() const;
+
+		PSDStatus status() const;
+
+	private:
+		class PSDEncoderImpl;
+		PSDEncoderImpl* m_encoder;
+	};
+}
+
+#endif
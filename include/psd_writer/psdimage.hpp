@@ -6,9 +6,12 @@
 #define PSDIMAGE_H
 
 #include "psdtypes.hpp"
+#include "psdzip.hpp"
 
 #include <cstdint>
+#include <cstddef>
 #include <vector>
+#include <memory>
 
 namespace psdimpl
 {
@@ -16,34 +19,57 @@ namespace psdimpl
 	{
 		uint16_t compression{};
 		std::vector<uint8_t> image_data{};
-		std::vector<uint16_t> bytecounts{};
+		std::vector<uint32_t> bytecounts{}; // 16 bits in a PSD, 32 in a PSB.
 	};
 
 	class PSDImage
 	{
 	public:
+		// Images are owned and deleted through PSDImage pointers.
+		PSDImage() = default;
+		PSDImage(const PSDImage&) = default;
+		PSDImage(PSDImage&&) = default;
+		PSDImage& operator=(const PSDImage&) = default;
+		PSDImage& operator=(PSDImage&&) = default;
+		virtual ~PSDImage() = default;
+
 		virtual psdw::PSDStatus load(const unsigned char* img,
 			psdimpl::ChannelOrder channel_order, int width, int height) = 0;
-		virtual psdw::PSDStatus load(std::vector<PSDChannel> img, int channels,
-			int width, int height) = 0;
+		virtual psdw::PSDStatus load(const std::vector<PSDChannel>& img,
+			int channels, int width, int height) = 0;
 
-		const std::vector<PSDChannel>& data() const { return m_image_data; }
+		const std::vector<PSDChannel>& data() const
+		{
+			return m_shared_data ? *m_shared_data : m_image_data;
+		}
 		int channels() const { return m_channels; }
 		int width() const { return m_width; }
 		int height() const { return m_height; }
 
 	protected:
-		// Given a pixel coordinate, retrieve the index of the corresponding
-		// element in the band-interleaved-by-pixel 1D array.
-		size_t get_index(int channels, int width, int channel,
-			int x, int y) const;
-
 		const std::vector<int> enumerate_channels(ChannelOrder channel_order) const;
 
+		// Split one band-interleaved-by-pixel row into a row per channel, in
+		// the order given by channels.
+		static void deinterleave_row(const unsigned char* src,
+			const std::vector<int>& channels, int width, uint8_t* const* rows);
+		// Store a whole band-interleaved-by-pixel image as raw channels.
+		void deinterleave(const unsigned char* img,
+			const std::vector<int>& channels, int width, int height);
+
 		int m_channels{};
 		int m_width{};
 		int m_height{};
 		std::vector<PSDChannel> m_image_data{}; // ARGB or RGB order.
+		// Read only channels shared between images, used in place of the above.
+		std::shared_ptr<const std::vector<PSDChannel>> m_shared_data{};
+	};
+
+	// A layer's image and where it sits on the canvas.
+	struct PSDPendingLayer
+	{
+		const PSDImage* image{};
+		psdw::PSDRect rect{};
 	};
 
 	class PSDRawImage : public PSDImage
@@ -51,26 +77,152 @@ namespace psdimpl
 	public:
 		psdw::PSDStatus load(const unsigned char* img,
 			ChannelOrder channel_order, int width, int height) override;
-		psdw::PSDStatus load(std::vector<PSDChannel> img, int channels,
-			int width, int height) override;
+		psdw::PSDStatus load(const std::vector<PSDChannel>& img,
+			int channels, int width, int height) override;
 
+		/* A single colour RGB image, stored as tiles of tile_size square. 
+		Tiles share the fill colour until they are composited onto, so data() 
+		is left empty and rows are read with row(). */
 		psdw::PSDStatus generate(int width, int height, psdw::PSDColour colour);
 
-		void composite(const unsigned char* foreground, psdw::PSDRect rect,
-			psdw::PSDChannelOrder foreground_channel_order);
+		/* Composite the ARGB layers, bottom first, over the image in one 
+		pass, with bands of tiles spread over the available cores. Each tile 
+		span is blended from the topmost layer that is opaque across it, so 
+		covered layers are never read. ZIP layers are inflated a band at a 
+		time, as the bands first read them. */
+		void composite(const std::vector<PSDPendingLayer>& layers);
+
+		/* Row y of a channel. Where the row is stored whole, it is returned 
+		directly, otherwise it is gathered into buffer, which must have room 
+		for width() bytes. */
+		const uint8_t* row(int channel, int y, uint8_t* buffer) const;
+		// Whether the image is still a single colour from generate.
+		bool uniform() const;
+		psdw::PSDColour fill() const { return m_fill; }
+
+		static constexpr int tile_size{ 256 };
+
+	private:
+		/* Pixel x of row y of a channel, allocating its tile with the fill 
+		colour if need be. The row is contiguous to the end of the tile. */
+		uint8_t* writable_row(int channel, int x, int y);
+		// Index into m_tiles of the tile holding pixel x of row y.
+		size_t tile_index(int channel, int x, int y) const;
+		int tile_width(int x) const;
+		// A layer's overlap with the image, and how to read its rows.
+		struct LayerSource;
+		static bool prepare_source(const PSDPendingLayer& layer,
+			int width, int height, LayerSource& source);
+		static const uint8_t* read_source_row(const LayerSource& source,
+			int channel, int y, uint8_t* buffer);
+		/* The rows of a ZIP channel in a band, inflating up to them if need 
+		be. They are kept until the band is released. */
+		static const uint8_t* inflate_band(const LayerSource& source,
+			int channel, int band);
+		static void release_band(const LayerSource& source, int band);
+		/* Composite rows top to bottom, within one band, which mustn't share 
+		tiles with others. */
+		void composite_rows(const std::vector<LayerSource>& sources, int top,
+			int bottom);
+		/* Blend count pixels of red, green, blue and alpha rows fg over the 
+		red, green and blue rows bg, 16 at a time where SSE2 is available. 
+		Opaque runs are copied and transparent runs skipped. */
+		static void blend_span(const uint8_t* const* fg, uint8_t* const* bg,
+			int count);
+
+		bool m_generated{ false };
+		psdw::PSDColour m_fill{};
+		std::vector<std::vector<uint8_t>> m_fill_rows{}; // One per channel.
+		int m_tiles_across{};
+		int m_tiles_down{};
+		/* Tiles written since generate, by channel, then row, then column, 
+		each row major and clipped to the image. Others are empty. */
+		std::vector<std::vector<uint8_t>> m_tiles{};
 	};
 
 	class PSDCompressedImage : public PSDImage
 	{
 	public:
+		/* With PSDCompression::Auto, each channel is stored with RLE or raw,
+		whichever is smaller. ZIP and ZIPPrediction deflate every channel at
+		zip_level, 0 to 9. RLEOptimal packs every channel as small as RLE
+		allows. Otherwise every channel uses RLE. bytecount_size is the size 
+		of each row's length in the file it will be saved to, which Auto 
+		counts against RLE. */
+		PSDCompressedImage(
+			psdw::PSDCompression compression = psdw::PSDCompression::RLE,
+			int zip_level = PSDZip::default_level,
+			size_t bytecount_size = sizeof(uint16_t))
+			: m_compression{ compression }, m_zip_level{ zip_level }
+			, m_bytecount_size{ bytecount_size } {}
+
 		psdw::PSDStatus load(const unsigned char* img,
 			ChannelOrder channel_order, int width, int height) override;
-		psdw::PSDStatus load(std::vector<PSDChannel> img, int channels,
-			int width, int height) override;
+		psdw::PSDStatus load(const std::vector<PSDChannel>& img,
+			int channels, int width, int height) override;
+		psdw::PSDStatus load(const PSDRawImage& img);
+
+		/* Pack width contiguous bytes into out with PackBits. out must have 
+		room for max_packed_length(width) bytes. Returns the number of bytes 
+		written. */
+		static size_t pack_row(const uint8_t* row, int width, uint8_t* out);
+		/* As pack_row, but the shortest possible encoding, which may differ 
+		from Photoshop's. scratch is resized as needed, and can be reused 
+		between rows. */
+		static size_t pack_row_optimal(const uint8_t* row, int width,
+			uint8_t* out, std::vector<int>& scratch);
+		static size_t max_packed_length(int width);
+		/* Unpack a row packed with PackBits into width bytes of out. Returns 
+		false if it doesn't unpack to exactly width bytes. */
+		static bool unpack_row(const uint8_t* packed, size_t length, int width,
+			uint8_t* out);
+
+		/* A single colour RGB image, packed without building it first. The 
+		channels are cached, and shared by every image generated with the 
+		same size and colour while any of them exist. */
+		psdw::PSDStatus generate(int width, int height, psdw::PSDColour colour);
+
+		// Bytes RLEOptimal saved over Photoshop's encoding of the same rows.
+		uint64_t savings() const { return m_savings; }
 
 	private:
-		void finalise_pack(std::vector<uint8_t>& buf, uint16_t& bytes);
-		void finalise_pack(const uint8_t val, int& reps, uint16_t& bytes);
+		// Bytes of input per unit of work when packing rows concurrently.
+		static constexpr size_t band_size{ 1 << 18 };
+		// Rows packed to choose each channel's compression in Auto mode.
+		static constexpr int sample_rows{ 64 };
+
+		void choose_compression(const unsigned char* img,
+			const std::vector<int>& channels);
+		/* Load band sequential channels. read_row(channel, y, buffer) returns 
+		a row, which it may first gather into buffer. */
+		template <typename ReadRow>
+		psdw::PSDStatus load_planes(int channels, int width, int height,
+			ReadRow&& read_row);
+		/* Pack the RLE channels, already marked by the caller, in concurrent
+		bands of rows. read_row(y, buffers, rows) either fills buffers with
+		row y of each channel, or points rows straight at it. For raw channels,
+		buffers is the row's place in the channel. */
+		template <typename ReadRow>
+		void pack_bands(ReadRow&& read_row);
+		// What pack_row makes of width copies of val.
+		static std::vector<uint8_t> pack_uniform_row(uint8_t val, int width);
+		// Whether RLE has made a channel no smaller than raw data.
+		bool inflated(const PSDChannel& channel) const;
+
+		// Deflate each channel of the raw image, concurrently.
+		void deflate_channels(bool prediction);
+
+		/* Run detection, 16 or 32 bytes at a time where SSE2 or AVX2 is 
+		available. Neither reads at or beyond end. */
+		// Index of the first byte from start that differs from row[start].
+		static int find_run_end(const uint8_t* row, int start, int end);
+		// Index of the first run of three from start, or end if there isn't one.
+		static int find_triple(const uint8_t* row, int start, int end);
+
+		psdw::PSDCompression m_compression;
+		int m_zip_level;
+		size_t m_bytecount_size; // 2 in a PSD, 4 in a PSB.
+		uint64_t m_savings{};
 	};
 }
 
@@ -0,0 +1,87 @@
+// Copyright (c) 2024 Dan Kemp. All rights reserved.
+// This source code is licensed under the MIT license found in the 
+// LICENSE file in the root directory of this source tree.
+
+#ifndef PSDLAYOUT_H
+#define PSDLAYOUT_H
+
+#include "psddata.hpp"
+#include "psdimage.hpp"
+#include "psdtypes.hpp"
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace psdimpl
+{
+	struct ChannelLayout
+	{
+		int16_t id{};
+		uint64_t offset{};
+		uint64_t length{};
+	};
+
+	struct LayerLayout
+	{
+		uint64_t record_offset{};
+		uint32_t record_length{};
+		uint32_t extra_data_length{};
+		std::vector<ChannelLayout> channels{}; // ARGB or RGB order.
+	};
+
+	/* Every section length and file offset of a document, computed in a
+	single pass over the data. The writer relies on this alone, rather than 
+	recalculating lengths as it goes. */
+	struct PSDLayout
+	{
+		/* merged_data_length is the length of the merged image's compressed
+		rows, without bytecounts. If the document's format is Auto, PSB is 
+		chosen when the document won't fit in a PSD. */
+		PSDLayout(const PSDData& psd_data, uint64_t merged_data_length);
+		/* Plan in the given format, PSD or PSB, whatever the document's. 
+		The limits aren't checked. */
+		PSDLayout(const PSDData& psd_data, uint64_t merged_data_length,
+			psdw::PSDFormat planned_format);
+
+		// Bounds of the compressed rows once compressed with RLE.
+		static uint64_t min_merged_data_length(int channels, int width,
+			int height);
+		static uint64_t max_merged_data_length(int channels, int width,
+			int height);
+
+		// False if the canvas or a layer is too big for a PSD.
+		static bool fits_psd_dimensions(const PSDData& psd_data);
+
+		static constexpr uint32_t max_psd_dimension{ 30000 };
+		static constexpr uint32_t max_psb_dimension{ 300000 };
+		static constexpr uint64_t max_psd_file_size{ 2147483648 };
+
+		uint16_t version() const;
+		// Size of the layer and mask section lengths and channel lengths.
+		size_t length_size() const;
+		// Size of each row's bytecount in RLE compressed image data.
+		size_t bytecount_size() const;
+
+		psdw::PSDFormat format{};
+		// False if the document was forced to be a PSD, but is too big.
+		bool within_limits{ true };
+		uint64_t colour_mode_data_offset{};
+		uint64_t image_resources_offset{};
+		uint32_t image_resources_length{};
+		uint64_t layer_and_mask_info_offset{};
+		uint64_t layer_and_mask_info_length{};
+		uint64_t layer_info_length{};
+		std::vector<LayerLayout> layers{};
+		uint64_t channel_data_offset{};
+		uint64_t channel_data_length{};
+		uint64_t image_data_offset{};
+		uint64_t image_data_length{};
+		uint64_t file_size{};
+
+	private:
+		void plan(const PSDData& psd_data, uint64_t merged_data_length);
+	};
+}
+
+#endif
@@ -11,15 +11,24 @@
 
 #include <cstdint>
 #include <string>
+#include <vector>
+#include <ostream>
+#include <future>
 #include <filesystem>
 
+namespace psdimpl
+{
+	struct PSDData;
+}
+
 namespace psdw
 {
 	class DllExport PSDocument
 	{
 	public:
 		/* Initialises a blank, RGB, 8BPC document. 
-		doc_width and doc_height must be between 1 and 30,000 pixels. */
+		doc_width and doc_height must be between 1 and 300,000 pixels. 
+		Documents over 30,000 pixels can only be saved as a PSB. */
 		PSDocument(int doc_width, int doc_height,
 			const PSDColour doc_background_rgb={ 255, 255, 255 });
 
@@ -35,6 +44,23 @@ namespace psdw
 
 		PSDStatus set_profile(std::filesystem::path icc_profile);
 
+		/* Choose between PSD and PSB (Large Document Format). Auto saves a 
+		PSD unless the document exceeds its dimensions or 2GiB, in which case
+		a PSB is saved. Saving a document that is too large as a PSD fails
+		with PSDStatus::FileWriteError, before anything is written. */
+		PSDStatus set_format(PSDFormat format);
+
+		/* Deflate level, from 0 (no compression) to 9 (smallest), for layers
+		added afterwards with ZIP or ZIPPrediction. The default is 6. */
+		PSDStatus set_zip_level(int level);
+
+		/* Photoshop's Maximize Compatibility. When off, the merged image 
+		isn't composited at all. A white placeholder is saved in its place, 
+		which packs to a few bytes a row, and readers are told to composite 
+		the layers themselves. Photoshop does, but other readers may only 
+		see the placeholder. On by default. */
+		PSDStatus set_maximize_compatibility(bool maximize);
+
 		PSDStatus add_guide(int position, PSDOrientation orientation);
 
 		/* img should be a pointer to an 8BPC band-interleaved-by-pixel colour 
@@ -43,7 +69,11 @@ namespace psdw
 		the array. Compression can either be turned off with None or set to 
 		RLE for PackBits run-length encoding. Using RLE will result in a much 
 		smaller file for layers with simple graphics but may inflate file size
-		for photographs. */
+		for photographs. Auto chooses between the two for each channel, so 
+		that neither kind of layer is inflated. ZIP deflates each channel, and
+		ZIPPrediction does so after differencing each row, which usually gives
+		the smallest photographs. Both are slower to save than RLE. 
+		RLEOptimal trades speed for the smallest possible RLE. */
 		PSDStatus add_layer(const unsigned char* img,
 			PSDRect rect,
 			std::string layer_name,
@@ -51,12 +81,54 @@ namespace psdw
 			PSDChannelOrder channel_order=PSDChannelOrder::BGRA,
 			PSDCompression compression=PSDCompression::RLE);
 
+		/* Composite layers added since the last flatten into the merged 
+		image. Layers are composited together, once, so saving does this 
+		itself, and it is only needed to choose when the work is done. */
+		PSDStatus flatten();
+
+		/* Standard mode writes the file with concurrent positional writes. 
+		MemoryMapped mode maps the output file and compresses the merged 
+		image directly into it, avoiding an in-memory copy of its compressed
+		data. It fails if the file's space can't be allocated up front. */
 		PSDStatus save(const std::filesystem::path& filename,
-			bool overwrite=false);
+			bool overwrite=false,
+			PSDSaveMode mode=PSDSaveMode::Standard);
+
+		/* Save in the background. The document's contents are moved into the 
+		job, so a new document can be built straight away, but this one can't
+		be used again. Any later calls return PSDStatus::InvalidArgument. */
+		std::future<PSDStatus> save_async(const std::filesystem::path& filename,
+			bool overwrite=false,
+			PSDSaveMode mode=PSDSaveMode::Standard);
+
+		/* Encode the document into buffer rather than a file. buffer is 
+		resized to exactly the length of the PSD. */
+		PSDStatus save_to_memory(std::vector<uint8_t>& buffer);
+
+		/* Stream the document, from start to finish, to sink or stream in
+		chunks of around 1MiB. Nothing is sent if the document is too big to
+		save. */
+		PSDStatus save(const PSDSink& sink);
+		PSDStatus save(std::ostream& stream);
+
+		/* Upper bound of the saved file size, in bytes. Everything is exact 
+		except the merged image, which is assumed to compress as badly as 
+		possible. Returns 0 if the document has been released by 
+		save_async. */
+		uint64_t estimated_size() const;
+
+		/* Bytes saved by layers added with PSDCompression::RLEOptimal, 
+		compared with packing the same layers as Photoshop does. Returns 0 
+		if the document has been released by save_async. */
+		uint64_t rle_savings() const;
 
 		PSDStatus status() const;
 
 	private:
+		friend class PSDEncoder;
+		// nullptr if the contents have been released by save_async.
+		const psdimpl::PSDData* data() const;
+
 		// pImpl to simplify DLL interface.
 		class PSDocumentImpl;
 		PSDocumentImpl* m_psdocument;
@@ -0,0 +1,110 @@
+// Copyright (c) 2024 Dan Kemp. All rights reserved.
+// This source code is licensed under the MIT license found in the 
+// LICENSE file in the root directory of this source tree.
+
+#ifndef PSDOUTPUT_H
+#define PSDOUTPUT_H
+
+#include "psdtypes.hpp"
+
+#include <cstdint>
+#include <cstddef>
+#include <filesystem>
+
+namespace psdimpl
+{
+	// Destination for a serialised document.
+	class PSDOutput
+	{
+	public:
+		virtual ~PSDOutput() = default;
+
+		/* Write size bytes at the given file offset. If concurrent() is true
+		this may be called from several threads at once, in any order. 
+		Otherwise calls are made one at a time, in file order. */
+		virtual bool write(uint64_t offset, const char* data, size_t size) = 0;
+		virtual bool concurrent() const = 0;
+	};
+
+	/* Positional writes to a file, extended to its final size up front. Its 
+	blocks aren't allocated, so it may be sparse until written. */
+	class PSDFileOutput : public PSDOutput
+	{
+	public:
+		PSDFileOutput(const std::filesystem::path& filepath, uint64_t size);
+		~PSDFileOutput();
+		PSDFileOutput(const PSDFileOutput&) = delete;
+		PSDFileOutput& operator=(const PSDFileOutput&) = delete;
+
+		bool write(uint64_t offset, const char* data, size_t size) override;
+		bool concurrent() const override { return true; }
+
+		bool is_open() const;
+		bool close();
+
+	protected:
+#ifdef _WIN32
+		void* m_handle{ nullptr };
+#else
+		int m_fd{ -1 };
+#endif
+	};
+
+	/* A caller-owned block of memory, holding size bytes of the file from 
+	offset onwards. */
+	class PSDMemoryOutput : public PSDOutput
+	{
+	public:
+		PSDMemoryOutput(uint8_t* data, size_t size, uint64_t offset = 0);
+
+		bool write(uint64_t offset, const char* data, size_t size) override;
+		bool concurrent() const override { return true; }
+
+	private:
+		uint8_t* m_data{ nullptr };
+		size_t m_size{};
+		uint64_t m_offset{};
+	};
+
+	// A user-supplied consumer, fed strictly in file order.
+	class PSDSinkOutput : public PSDOutput
+	{
+	public:
+		PSDSinkOutput(const psdw::PSDSink& sink);
+
+		bool write(uint64_t offset, const char* data, size_t size) override;
+		bool concurrent() const override { return false; }
+
+	private:
+		const psdw::PSDSink& m_sink;
+		uint64_t m_position{};
+	};
+
+	/* A file of the given size, with its blocks allocated up front. If 
+	they can't be, the output isn't opened. Data can be copied in with 
+	write(), or produced in place through one mapped window at a time. */
+	class PSDMappedOutput : public PSDFileOutput
+	{
+	public:
+		PSDMappedOutput(const std::filesystem::path& filepath, uint64_t size);
+		~PSDMappedOutput();
+
+		/* Map size bytes of the file from offset onwards, unmapping the 
+		previous window. Returns the address of offset, or nullptr. */
+		char* map(uint64_t offset, size_t size);
+		// Unmap and close the file, truncating it to final_size bytes.
+		bool close(uint64_t final_size);
+
+	private:
+		bool unmap();
+
+		uint64_t m_size{};
+		char* m_view{ nullptr };
+		size_t m_view_size{};
+#ifdef _WIN32
+		void* m_mapping{ nullptr };
+#endif
+	};
+}
+
+#endif
@@ -0,0 +1,82 @@
+// Copyright (c) 2024 Dan Kemp. All rights reserved.
+// This source code is licensed under the MIT license found in the 
+// LICENSE file in the root directory of this source tree.
+
+#ifndef PSDPARALLEL_H
+#define PSDPARALLEL_H
+
+#include <cstddef>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+namespace psdimpl
+{
+	/* Worker threads shared by every parallel_for, one fewer than the cores 
+	available. It is created on first use and lives for the rest of the 
+	process, so that no worker has to be joined while the process exits or 
+	the library is unloaded. */
+	class PSDThreadPool
+	{
+	public:
+		using Call = void (*)(void* context, size_t i);
+
+		static PSDThreadPool& instance();
+
+		size_t workers() const { return m_workers; }
+
+		/* Calls call(context, i) for every i in [0, count) on the calling 
+		thread and any idle workers, returning once every call has finished.
+		The caller never waits for a worker to start, so calls can be 
+		nested, or made from several threads at once. */
+		void run(size_t count, Call call, void* context);
+
+	private:
+		struct Job
+		{
+			size_t count{};
+			Call call{};
+			void* context{};
+			std::atomic<size_t> next{};
+			// Workers running the job, guarded by m_mutex.
+			size_t active{};
+
+			void run();
+		};
+
+		PSDThreadPool();
+		void work();
+
+		size_t m_workers{};
+		std::mutex m_mutex{};
+		std::condition_variable m_work{};
+		std::condition_variable m_idle{};
+		std::vector<Job*> m_jobs{};
+	};
+
+	/* Calls task(i) for every i in [0, count), spread over the available 
+	cores. The calling thread takes part, and the call returns once every 
+	task has finished. Tasks must not throw. */
+	template <typename Task>
+	void parallel_for(size_t count, Task&& task)
+	{
+		PSDThreadPool& pool{ PSDThreadPool::instance() };
+		if (count <= 1 || pool.workers() == 0)
+		{
+			for (size_t i{}; i < count; ++i)
+				task(i);
+			return;
+		}
+
+		using Callable = std::remove_reference_t<Task>;
+		pool.run(count, [](void* context, size_t i)
+			{
+				(*static_cast<Callable*>(context))(i);
+			},
+			const_cast<void*>(static_cast<const void*>(&task)));
+	}
+}
+
+#endif
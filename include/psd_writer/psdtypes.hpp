@@ -6,6 +6,8 @@
 #define PSDTYPES_H
 
 #include <cstdint>
+#include <cstddef>
+#include <functional>
 
 // User accessible types.
 namespace psdw
@@ -41,11 +43,37 @@ namespace psdw
 		BGRA
 	};
 
+	/* ZIP is deflate, and ZIPPrediction deflate after differencing each row,
+	which suits photographs and gradients. RLEOptimal finds the smallest
+	PackBits encoding of each row, rather than matching Photoshop's. */
 	enum class PSDCompression
 	{
 		None,
-		RLE
+		RLE,
+		Auto,
+		ZIP,
+		ZIPPrediction,
+		RLEOptimal
 	};
+
+	/* PSB, the Large Document Format, lifts the 30,000 pixel and 2GiB limits
+	of a PSD. Auto uses PSD where possible. */
+	enum class PSDFormat
+	{
+		Auto,
+		PSD,
+		PSB
+	};
+
+	enum class PSDSaveMode
+	{
+		Standard,
+		MemoryMapped
+	};
+
+	/* Receives an encoded document in consecutive chunks. Return false to
+	abandon the save. */
+	using PSDSink = std::function<bool(const unsigned char* data, size_t size)>;
 }
 
 // Internal types.
@@ -6,12 +6,14 @@
 #define PSDWRITER_H
 
 #include "psddata.hpp"
+#include "psdlayout.hpp"
+#include "psdoutput.hpp"
 #include "psdtypes.hpp"
 
 #include <string>
 #include <filesystem>
-#include <fstream>
 #include <cstdint>
+#include <cstddef>
 #include <vector>
 
 namespace psdimpl
@@ -22,10 +24,95 @@ namespace psdimpl
 		PSDWriter(const PSDData& psd_data);
 
 		psdw::PSDStatus write(const std::filesystem::path& filepath,
-			bool overwrite);
+			bool overwrite, psdw::PSDSaveMode mode);
+		psdw::PSDStatus write(std::vector<uint8_t>& buffer);
+		psdw::PSDStatus write(const psdw::PSDSink& sink);
+
+		// Serialise the sections before and after the layer channel data.
+		psdw::PSDStatus write_records(const PSDLayout& layout,
+			std::vector<uint8_t>& buffer);
+		psdw::PSDStatus write_global_layer_info(const PSDLayout& layout,
+			std::vector<uint8_t>& buffer);
+
+		// Plan for the largest possible merged image, without compressing it.
+		PSDLayout plan_largest() const;
+		/* Plan for the largest possible merged image, but in the format the 
+		real merged image would be saved in. */
+		PSDLayout plan_mapped();
+		/* Pack the merged image once to measure it, keeping the length of 
+		each row, by channel then row, in bytecounts, and plan the document. 
+		If keep_packed, bands of packed rows are kept, up to a budget, for 
+		write_image_data. If the document can't fit its format whatever the 
+		merged image compresses to, it isn't measured and the layout returned 
+		is not within limits. */
+		PSDLayout plan_measured(std::vector<uint32_t>& bytecounts,
+			bool keep_packed = false);
+		// The merged image, or a placeholder if it is left out.
+		const PSDRawImage& merged_source();
 		psdw::PSDStatus status() { return m_status; }
 
 	private:
+		// A block of existing data, destined for a known file offset.
+		struct Span
+		{
+			uint64_t offset{};
+			const char* data{};
+			size_t size{};
+		};
+
+		// Size of the staging buffer that small values pass through.
+		static constexpr size_t buffer_size{ 1 << 20 };
+		// Largest unit of work when writing spans concurrently.
+		static constexpr size_t span_size_limit{ 1 << 22 };
+		// Bytes of the merged image packed per unit of work.
+		static constexpr size_t band_size{ 1 << 18 };
+		// Bytes of the merged image packed before each write.
+		static constexpr size_t batch_size{ 1 << 24 };
+		// Packed bytes of the merged image kept from measuring it.
+		static constexpr size_t packed_budget{ 1 << 26 };
+		// Bytes of the file mapped at once when saving memory mapped.
+		static constexpr size_t window_size{ 1 << 24 };
+
+		// The last stored merged row packed, reused while it repeats.
+		struct PackedRow
+		{
+			const uint8_t* source{};
+			std::vector<uint8_t> data{};
+		};
+
+		bool write_positional(const std::filesystem::path& filepath,
+			const PSDLayout& layout,
+			const std::vector<uint32_t>& merged_bytecounts);
+		bool write_mapped(const std::filesystem::path& filepath,
+			const PSDLayout& layout);
+
+		// Serialise the document, section by section, to output.
+		void begin(PSDOutput& output, uint64_t offset = 0);
+		void write_layers(const PSDLayout& layout);
+		void write_records(const PSDLayout& layout);
+		void write_channels(const PSDLayout& layout);
+		void write_global_layer_info(const PSDLayout& layout);
+		// Pack and write the merged image, as measured by plan_measured.
+		void write_image_data(const std::vector<uint32_t>& bytecounts,
+			const PSDLayout& layout);
+		/* Pack a row of the merged image into out, which must have room for 
+		a packed row, and return its length. Rows crossing only untouched 
+		tiles are all the same fill row, so are copied from last once packed. */
+		static size_t pack_merged_row(const PSDRawImage& image, int channel,
+			int y, uint8_t* buffer, uint8_t* out, PackedRow& last);
+		bool end();
+
+		uint64_t position() const;
+		void append(const char* data, size_t size);
+		void flush();
+		void add_spans(std::vector<Span>& spans, uint64_t offset,
+			const char* data, size_t size);
+		// Write spans, which must end at the file offset end.
+		void write_spans(const std::vector<Span>& spans, uint64_t end);
+		// Append the lowest size bytes of val to out, in big-endian order.
+		static void big_endian(uint64_t val, size_t size,
+			std::vector<char>& out);
+
 		constexpr bool little_endian();
 
 		void write(const uint8_t& val);
@@ -33,15 +120,18 @@ namespace psdimpl
 		void write(const int16_t& val);
 		void write(const uint32_t& val);
 		void write(const int32_t& val);
+		void write(const uint64_t& val);
+		// Write a section or channel length of size bytes, 4 or 8.
+		void write_length(uint64_t val, size_t size);
 		void write(const double& val);
 		void write_with_null(const double& val);
 		void write(const std::vector<char>& val);
 		void write(const std::vector<uint8_t>& val);
-		void write(const std::vector<uint16_t>& val);
+		// Write RLE bytecounts of size bytes each, 2 or 4.
+		void write_bytecounts(const std::vector<uint32_t>& val, size_t size);
 		void write(const std::string& val);
 		void write(const psdimpl::PascalString& val);
 		void write(const psdimpl::LayerRect& val);
-		void write(const psdimpl::ChannelInfo& val);
 		void write(const psdimpl::LayerBlendingRanges& val);
 		void write(const psdimpl::AdditionalLayerInfo& val);
 		void write(const psdimpl::AdditionalLayerInfoLuni& val);
@@ -53,7 +143,14 @@ namespace psdimpl
 
 		psdw::PSDStatus m_status;
 		const PSDData& m_data;
-		std::ofstream m_writer;
+		PSDOutput* m_output{ nullptr };
+		uint64_t m_offset{}; // File offset of the start of m_buffer.
+		bool m_failed{ false };
+		std::vector<char> m_buffer{};
+		size_t m_buffer_pos{};
+		PSDRawImage m_placeholder{};
+		// Bands of the merged image kept packed, or empty, by band.
+		std::vector<std::vector<uint8_t>> m_packed_bands{};
 	};
 }
 
@@ -0,0 +1,117 @@
+// Copyright (c) 2024 Dan Kemp. All rights reserved.
+// This source code is licensed under the MIT license found in the 
+// LICENSE file in the root directory of this source tree.
+
+#ifndef PSDZIP_H
+#define PSDZIP_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace psdimpl
+{
+	/* Self-contained zlib (RFC 1950) streams for ZIP compressed channels, so
+	the library keeps no dependencies. Deflate (RFC 1951) uses hash chained
+	LZ77, and each block is stored, or coded with fixed or dynamic Huffman
+	codes, whichever is smallest. */
+	class PSDZip
+	{
+	public:
+		static constexpr int default_level{ 6 };
+		static constexpr int max_level{ 9 };
+
+		/* Compress size bytes of data. level runs from 0, stored, to 9,
+		smallest, with the same trade-offs as zlib. */
+		static std::vector<uint8_t> compress(const uint8_t* data, size_t size,
+			int level = default_level);
+		/* Decompress a zlib stream into out, which it must fill exactly.
+		Returns false if the stream is malformed or the wrong size. */
+		static bool decompress(const uint8_t* data, size_t size, uint8_t* out,
+			size_t out_size);
+
+		/* Prediction for ZIP with prediction channels. Each byte of an 8-bit
+		row is replaced by its difference from the byte before. */
+		static void predict(uint8_t* data, int width, int height);
+		static void unpredict(uint8_t* data, int width, int height);
+
+		/* Inflates a zlib stream a piece at a time, so rows can be read 
+		without inflating the whole channel. Between pieces, only the last 
+		32KiB, which later matches may refer back to, is kept. */
+		class Inflater
+		{
+		public:
+			Inflater(const uint8_t* data, size_t size);
+
+			/* Inflate the next size bytes into out. Returns false if the 
+			stream is malformed or ends first, after which every read fails. */
+			bool read(uint8_t* out, size_t size);
+			/* Whether the stream ends, with a matching checksum, after what 
+			has been read. Call it once. */
+			bool finish();
+
+		private:
+			// Every code of up to the longest length maps to its symbol and length.
+			struct Table
+			{
+				std::vector<uint16_t> entries{};
+				int bits{};
+			};
+			enum class State { Header, Stored, Codes };
+
+			/* Inflate until out is full or, if to_end, until the last block 
+			ends, when any more output is an error. */
+			bool inflate(bool to_end);
+			bool header();
+			bool build(Table& table, const uint8_t* lengths, int count);
+			// Returns -1 for a code not in the table.
+			int decode(const Table& table);
+			bool dynamic();
+			bool codes(bool to_end);
+			bool stored();
+			// Copy what fits of a match that reaches back before out.
+			void copy_match();
+			/* Top the buffer up to at least count bits. Past the end of the 
+			input, zeros are read, and using them marks the stream as overrun. */
+			void refill(int count);
+			void consume(int count);
+			uint32_t bits(int count);
+			void align();
+
+			static constexpr size_t window_size{ 32768 };
+
+			const uint8_t* m_data{};
+			size_t m_size{};
+			size_t m_position{};
+			uint64_t m_bit_buffer{};
+			int m_bit_count{};
+			int m_padding{}; // Bits of zeros read past the end of the input.
+			bool m_overrun{ false };
+			bool m_failed{ false };
+			State m_state{ State::Header };
+			bool m_last{ false }; // Whether the current block is the last.
+			size_t m_stored_length{}; // Left to copy of a stored block.
+			size_t m_match_length{}; // Left to copy of a match, and its distance.
+			size_t m_match_distance{};
+			Table m_literals{};
+			Table m_distances{};
+			// The piece being read.
+			uint8_t* m_out{};
+			size_t m_out_size{};
+			size_t m_written{};
+			// Everything before it.
+			uint64_t m_total{};
+			uint32_t m_checksum{ 1 };
+			std::vector<uint8_t> m_window{};
+		};
+
+	private:
+		class Deflater;
+
+		// Adler-32 of data, continuing from a checksum of earlier data.
+		static uint32_t adler32(const uint8_t* data, size_t size,
+			uint32_t adler = 1);
+	};
+}
+
+#endif
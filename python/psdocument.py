@@ -34,6 +34,13 @@ class PSDocument(object):
         lib.set_profile.argtypes = [ctypes.c_void_p, ctypes.c_wchar_p]
         lib.set_profile.restype = ctypes.c_bool
 
+        lib.set_format.argtypes = [ctypes.c_void_p, ctypes.c_int]
+        lib.set_format.restype = ctypes.c_bool
+
+        lib.set_maximize_compatibility.argtypes = [ctypes.c_void_p,
+                                                   ctypes.c_bool]
+        lib.set_maximize_compatibility.restype = ctypes.c_bool
+
         lib.add_guide.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_int]
         lib.add_guide.restype = ctypes.c_bool
 
@@ -48,6 +55,21 @@ class PSDocument(object):
         lib.save.argtypes = [ctypes.c_void_p, ctypes.c_wchar_p, ctypes.c_bool]
         lib.save.restype = ctypes.c_bool
 
+        lib.estimated_size.argtypes = [ctypes.c_void_p]
+        lib.estimated_size.restype = ctypes.c_uint64
+
+        lib.save_to_memory.argtypes = [ctypes.c_void_p]
+        lib.save_to_memory.restype = ctypes.c_void_p
+
+        lib.psd_buffer_data.argtypes = [ctypes.c_void_p]
+        lib.psd_buffer_data.restype = ctypes.c_void_p
+
+        lib.psd_buffer_size.argtypes = [ctypes.c_void_p]
+        lib.psd_buffer_size.restype = ctypes.c_size_t
+
+        lib.psd_buffer_delete.argtypes = [ctypes.c_void_p]
+        lib.psd_buffer_delete.restype = None
+
         self.obj = lib.psd_new(width, height)
 
     def __del__(self):
@@ -59,6 +81,12 @@ class PSDocument(object):
     def set_profile(self, profile_path):
         return lib.set_profile(self.obj, profile_path)
     
+    def set_format(self, psd_format):
+        return lib.set_format(self.obj, psd_format)
+    
+    def set_maximize_compatibility(self, maximize):
+        return lib.set_maximize_compatibility(self.obj, maximize)
+    
     def add_guide(self, position, orientation):
         return lib.add_guide(self.obj, position, orientation)
     
@@ -69,3 +97,15 @@ class PSDocument(object):
     def save(self, save_path, overwrite):
         return lib.save(self.obj, save_path, overwrite)
 
+    def estimated_size(self):
+        return lib.estimated_size(self.obj)
+
+    def save_to_memory(self):
+        buffer = lib.save_to_memory(self.obj)
+        if not buffer:
+            return None
+        data = ctypes.string_at(lib.psd_buffer_data(buffer),
+                                lib.psd_buffer_size(buffer))
+        lib.psd_buffer_delete(buffer)
+        return data
+
@@ -7,11 +7,17 @@
 
 #include <filesystem>
 #include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
 #include <locale>
 #include <codecvt>
 
 using namespace psdw;
 
+// Opaque handle to an encoded PSD held in memory.
+using PSDBuffer = std::vector<uint8_t>;
+
 extern "C"
 {
 	DllExport PSDocument* psd_new(int w, int h)
@@ -40,6 +46,22 @@ extern "C"
 		return response == PSDStatus::Success ? true : false;
 	}
 
+	DllExport bool set_format(
+		PSDocument* psd,
+		PSDFormat format)
+	{
+		PSDStatus response = psd->set_format(format);
+		return response == PSDStatus::Success ? true : false;
+	}
+
+	DllExport bool set_maximize_compatibility(
+		PSDocument* psd,
+		bool maximize)
+	{
+		PSDStatus response = psd->set_maximize_compatibility(maximize);
+		return response == PSDStatus::Success ? true : false;
+	}
+
 	DllExport bool add_guide(
 		PSDocument* psd,
 		int position,
@@ -75,4 +97,39 @@ extern "C"
 		PSDStatus response = psd->save(filename, overwrite);
 		return response == PSDStatus::Success ? true : false;
 	}
+
+	DllExport uint64_t estimated_size(
+		PSDocument* psd)
+	{
+		return psd->estimated_size();
+	}
+
+	// Returns nullptr on failure. Release with psd_buffer_delete.
+	DllExport PSDBuffer* save_to_memory(
+		PSDocument* psd)
+	{
+		PSDBuffer* buffer = new PSDBuffer();
+		PSDStatus response = psd->save_to_memory(*buffer);
+		if (response != PSDStatus::Success)
+		{
+			delete buffer;
+			return nullptr;
+		}
+		return buffer;
+	}
+
+	DllExport const unsigned char* psd_buffer_data(PSDBuffer* buffer)
+	{
+		return buffer->data();
+	}
+
+	DllExport size_t psd_buffer_size(PSDBuffer* buffer)
+	{
+		return buffer->size();
+	}
+
+	DllExport void psd_buffer_delete(PSDBuffer* buffer)
+	{
+		delete buffer;
+	}
 }
\ No newline at end of file
@@ -214,14 +214,11 @@ uint32_t LayerRecord::length() const
 {
     uint32_t length{};
 
+    // Each channel's id and a 4 byte length. PSB lengths are 8 bytes.
     uint32_t channel_info_length{
-        static_cast<uint32_t>(sizeof(alpha_channel_info.length)
-        + sizeof(alpha_channel_info.id)) };
-    if (alpha_channel_info.length != 0)
-    {
-        length += channel_info_length;
-    }
-    length += channel_info_length * 3;
+        static_cast<uint32_t>(sizeof(alpha_channel_info.id)
+        + sizeof(uint32_t)) };
+    length += channel_info_length * channel_count;
     length += 34;
     length += extra_data_length();
 
@@ -251,6 +248,25 @@ uint32_t LayerRecord::extra_data_length() const
     return length;
 }
 
+uint32_t Header::length() const
+{
+    return static_cast<uint32_t>(
+        file_signature.size()
+        + sizeof(uint16_t) // Version.
+        + reserved.size()
+        + sizeof(channel_count)
+        + sizeof(height)
+        + sizeof(width)
+        + sizeof(depth)
+        + sizeof(colour_mode));
+}
+
+uint32_t ColourModeData::length() const
+{
+    return static_cast<uint32_t>(sizeof(colour_mode_data_length))
+        + colour_mode_data_length;
+}
+
 uint32_t ImageResources::length() const
 {
     uint32_t length{};
@@ -264,6 +280,12 @@ uint32_t ImageResources::length() const
     length += grid_and_guides.length() % 2 == 0
         ? grid_and_guides.length() + prefix_length
         : grid_and_guides.length() + prefix_length + 1; // Pad to even.
+    if (!version_info.has_real_merged_data)
+    {
+        length += version_info.length() % 2 == 0
+            ? version_info.length() + prefix_length
+            : version_info.length() + prefix_length + 1; // Pad to even.
+    }
 
     return length;
 }
@@ -273,44 +295,20 @@ uint32_t ICCProfile::length() const
     return static_cast<uint32_t>(data.size());
 }
 
-uint32_t GridAndGuides::length() const
-{
-    uint32_t length{ 16 };
-
-    length += static_cast<uint32_t>(guides.size()) * 5;
-
-    return length;
-}
-
-uint32_t LayerAndMaskInfo::layer_and_mask_info_length() const
+uint32_t VersionInfo::length() const
 {
-    uint32_t length{};
-
-    uint32_t prefix_length{ 12 };
-    length += layer_info_length();
-    length += sizeof(uint32_t);
-    length += global_layer_mask_info.length();
-    length += patterns.length() + prefix_length;
-    length += filter_mask.length() + prefix_length;
-    length += compositor_info.length() + prefix_length;
-
-    return length;
+    return static_cast<uint32_t>(sizeof(version)
+        + sizeof(has_real_merged_data)
+        + sizeof(uint32_t) + writer_name.size() * 2
+        + sizeof(uint32_t) + reader_name.size() * 2
+        + sizeof(file_version));
 }
 
-uint32_t LayerAndMaskInfo::layer_info_length() const
+uint32_t GridAndGuides::length() const
 {
-    uint32_t length{};
+    uint32_t length{ 16 };
 
-    length += static_cast<uint32_t>(sizeof(layer_count()));
-    for (const LayerRecord &record : layer_records)
-    {
-        length += record.length();
-        length += record.alpha_channel_info.length;
-        length += record.red_channel_info.length;
-        length += record.green_channel_info.length;
-        length += record.blue_channel_info.length;
-    }
-    length += static_cast<uint32_t>(sizeof(mystery_null));
+    length += static_cast<uint32_t>(guides.size()) * 5;
 
     return length;
 }
@@ -0,0 +1,261 @@
+// Copyright (c) 2024 Dan Kemp. All rights reserved.
+// This source code is licensed under the MIT license found in the 
+// LICENSE file in the root directory of this source tree.
+
+#include "psdencoder.hpp"
+#include "psdocument.hpp"
+#include "psddata.hpp"
+#include "psdimage.hpp"
+#include "psdlayout.hpp"
+#include "psdwriter.hpp"
+#include "psdtypes.hpp"
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+using namespace psdw;
+using namespace psdimpl;
+
+// Implementation class.
+class PSDEncoder::PSDEncoderImpl
+{
+public:
+    PSDEncoderImpl(const PSDData& psd_data)
+        : m_writer{ psd_data }
+        , m_layout{ m_writer.plan_measured(m_merged_bytecounts) }
+        , m_merged_image{ m_writer.merged_source() }
+    {
+        // Check the document fits its format.
+        if (!m_layout.within_limits)
+        {
+            m_status = PSDStatus::FileWriteError;
+            return;
+        }
+
+        // Records and the global layer info are small, so are serialised up
+        // front. Everything else is read from the document as required.
+        m_status = m_writer.write_records(m_layout, m_records);
+        if (m_status == PSDStatus::Success)
+            m_status = m_writer.write_global_layer_info(m_layout, m_global_info);
+        if (m_status != PSDStatus::Success)
+            return;
+
+        add_bytes(m_records.data(), m_records.size());
+        for (const auto& image_ptr : psd_data.layer_and_mask_info.layer_image_data)
+        {
+            for (const PSDChannel& channel : image_ptr->data())
+            {
+                add_words(&channel.compression, 1);
+                add_counts(channel.bytecounts.data(), channel.bytecounts.size());
+                add_bytes(channel.image_data.data(), channel.image_data.size());
+            }
+        }
+        add_bytes(m_global_info.data(), m_global_info.size());
+
+        /* The merged image was measured while planning, and its rows are 
+        packed again as they are reached, so it is never held compressed. */
+        add_words(&m_merged_compression, 1);
+        add_counts(m_merged_bytecounts.data(), m_merged_bytecounts.size());
+        uint64_t merged_data_length{};
+        for (uint32_t bytecount : m_merged_bytecounts)
+            merged_data_length += bytecount;
+        if (merged_data_length)
+        {
+            m_segments.push_back({ nullptr, nullptr, nullptr, 1,
+                static_cast<size_t>(merged_data_length), true });
+        }
+        m_total += merged_data_length;
+        m_row.resize(static_cast<size_t>(m_merged_image.width()));
+        m_packed.resize(PSDCompressedImage::max_packed_length(
+            m_merged_image.width()));
+
+        if (m_total != m_layout.file_size)
+            m_status = PSDStatus::FileWriteError;
+    }
+
+    size_t next_chunk(unsigned char* buffer, size_t size)
+    {
+        if (m_status != PSDStatus::Success)
+            return 0;
+
+        size_t filled{};
+        while (filled < size && m_segment < m_segments.size())
+        {
+            const Segment& segment{ m_segments[m_segment] };
+            size_t length{ std::min(size - filled, segment.size - m_position) };
+            if (segment.merged)
+            {
+                fill_merged(buffer, length);
+                buffer += length;
+            }
+            else if (segment.words || segment.counts)
+            {
+                // Convert to big-endian, one byte at a time, as a chunk may 
+                // end half way through a value.
+                for (size_t i{ m_position }; i < m_position + length; ++i)
+                {
+                    uint32_t val{ segment.words
+                        ? segment.words[i / segment.width]
+                        : segment.counts[i / segment.width] };
+                    size_t shift{ (segment.width - 1 - i % segment.width) * 8 };
+                    *buffer++ = static_cast<unsigned char>(val >> shift);
+                }
+            }
+            else
+            {
+                std::memcpy(buffer, segment.bytes + m_position, length);
+                buffer += length;
+            }
+
+            filled += length;
+            m_position += length;
+            if (m_position == segment.size)
+            {
+                m_segment++;
+                m_position = 0;
+            }
+        }
+
+        return filled;
+    }
+
+    bool done() const
+    {
+        return m_status != PSDStatus::Success
+            || m_segment == m_segments.size();
+    }
+
+    uint64_t size() const { return m_layout.file_size; }
+
+    PSDStatus status() const { return m_status; }
+
+private:
+    // A part of the file, stored either as bytes or as 16 or 32-bit values.
+    struct Segment
+    {
+        const uint8_t* bytes{};
+        const uint16_t* words{};
+        const uint32_t* counts{};
+        size_t width{}; // Size of each value in the file.
+        size_t size{}; // In bytes.
+        bool merged{ false }; // The merged image's rows, packed as reached.
+    };
+
+    // Copy the next size bytes of the merged image's packed rows.
+    void fill_merged(unsigned char* buffer, size_t size)
+    {
+        while (size > 0)
+        {
+            if (m_packed_position == m_packed_length)
+            {
+                const int height{ m_merged_image.height() };
+                const int c{ static_cast<int>(m_merged_row / height) };
+                const int y{ static_cast<int>(m_merged_row % height) };
+                m_packed_length = PSDCompressedImage::pack_row(
+                    m_merged_image.row(c, y, m_row.data()),
+                    m_merged_image.width(), m_packed.data());
+                m_packed_position = 0;
+                m_merged_row++;
+            }
+            size_t length{ std::min(size, m_packed_length - m_packed_position) };
+            std::memcpy(buffer, m_packed.data() + m_packed_position, length);
+            buffer += length;
+            size -= length;
+            m_packed_position += length;
+        }
+    }
+
+    void add_bytes(const uint8_t* data, size_t size)
+    {
+        if (size)
+            m_segments.push_back({ data, nullptr, nullptr, 1, size });
+        m_total += size;
+    }
+
+    void add_words(const uint16_t* data, size_t count)
+    {
+        if (count)
+        {
+            m_segments.push_back({ nullptr, data, nullptr, sizeof(uint16_t),
+                count * sizeof(uint16_t) });
+        }
+        m_total += count * sizeof(uint16_t);
+    }
+
+    // RLE bytecounts, which are narrowed to 16 bits in a PSD.
+    void add_counts(const uint32_t* data, size_t count)
+    {
+        size_t width{ m_layout.bytecount_size() };
+        if (count)
+        {
+            m_segments.push_back({ nullptr, nullptr, data, width,
+                count * width });
+        }
+        m_total += count * width;
+    }
+
+    PSDStatus m_status{ PSDStatus::Success };
+    std::vector<uint32_t> m_merged_bytecounts{};
+    PSDWriter m_writer;
+    const PSDLayout m_layout;
+    const PSDRawImage& m_merged_image;
+    const uint16_t m_merged_compression{ 1 };
+    std::vector<uint8_t> m_row{};
+    std::vector<uint8_t> m_packed{};
+    size_t m_merged_row{};
+    size_t m_packed_length{};
+    size_t m_packed_position{};
+    std::vector<uint8_t> m_records{};
+    std::vector<uint8_t> m_global_info{};
+    std::vector<Segment> m_segments{};
+    uint64_t m_total{};
+    size_t m_segment{};
+    size_t m_position{}; // Within the current segment.
+};
+
+// Implementation of interface class.
+PSDEncoder::PSDEncoder(PSDocument& psd)
+    : m_encoder{ psd.flatten() == PSDStatus::Success
+        ? new PSDEncoderImpl(*psd.data()) : nullptr }
+{
+}
+
+PSDEncoder::~PSDEncoder()
+{
+    delete m_encoder;
+}
+
+PSDEncoder::PSDEncoder(PSDEncoder&& other) noexcept
+    : m_encoder{ std::exchange(other.m_encoder, nullptr) }
+{
+}
+
+PSDEncoder& PSDEncoder::operator=(PSDEncoder&& other) noexcept
+{
+    std::swap(m_encoder, other.m_encoder);
+    return *this;
+}
+
+size_t PSDEncoder::next_chunk(unsigned char* buffer, size_t size)
+{
+    return m_encoder ? m_encoder->next_chunk(buffer, size) : 0;
+}
+
+bool PSDEncoder::done() const
+{
+    return m_encoder ? m_encoder->done() : true;
+}
+
+uint64_t PSDEncoder::size() const
+{
+    return m_encoder ? m_encoder->size() : 0;
+}
+
+PSDStatus PSDEncoder::status() const
+{
+    return m_encoder ? m_encoder->status() : PSDStatus::InvalidArgument;
+}
@@ -3,21 +3,34 @@
 // LICENSE file in the root directory of this source tree.
 
 #include "psdimage.hpp"
+#include "psdparallel.hpp"
 #include "psdtypes.hpp"
+#include "psdzip.hpp"
 
 #include <vector>
 #include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <bit>
+#include <algorithm>
+#include <map>
+#include <tuple>
+#include <mutex>
+#include <memory>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define PSDW_AVX2
+#endif
+#if defined(__SSE2__) || defined(_M_X64) \
+    || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PSDW_SSE2
+#endif
 
 using namespace psdimpl;
 using namespace psdw;
 
-size_t PSDImage::get_index(int channels, int width, int channel,
-	int x, int y) const
-{
-	return static_cast<size_t>(y) * width * channels
-		+ static_cast<size_t>(x) * channels + channel;
-}
-
 const std::vector<int> PSDImage::enumerate_channels(
     ChannelOrder channel_order) const
 {
@@ -32,12 +45,72 @@ const std::vector<int> PSDImage::enumerate_channels(
     return channels;
 }
 
+void PSDImage::deinterleave_row(const unsigned char* src,
+    const std::vector<int>& channels, int width, uint8_t* const* rows)
+{
+    const size_t stride{ channels.size() };
+    if (stride == 4)
+    {
+        // The common case, unrolled.
+        uint8_t* r0{ rows[0] };
+        uint8_t* r1{ rows[1] };
+        uint8_t* r2{ rows[2] };
+        uint8_t* r3{ rows[3] };
+        const int c0{ channels[0] }, c1{ channels[1] },
+            c2{ channels[2] }, c3{ channels[3] };
+        for (int x{}; x < width; x++)
+        {
+            const unsigned char* pixel{ src + static_cast<size_t>(x) * 4 };
+            r0[x] = pixel[c0];
+            r1[x] = pixel[c1];
+            r2[x] = pixel[c2];
+            r3[x] = pixel[c3];
+        }
+        return;
+    }
+
+    for (int x{}; x < width; x++)
+    {
+        const unsigned char* pixel{ src + static_cast<size_t>(x) * stride };
+        for (size_t c{}; c < stride; c++)
+            rows[c][x] = pixel[channels[c]];
+    }
+}
+
+void PSDImage::deinterleave(const unsigned char* img,
+    const std::vector<int>& channels, int width, int height)
+{
+    // Read band-interleaved-by-pixel, store as band-sequential, in a single
+    // pass over the image.
+    m_image_data.resize(channels.size());
+    for (PSDChannel& channel : m_image_data)
+    {
+        channel.compression = 0;
+        channel.image_data.resize(static_cast<size_t>(width) * height);
+    }
+
+    const size_t row_stride{ static_cast<size_t>(width) * channels.size() };
+    uint8_t* rows[4]{};
+    for (int y{}; y < height; y++)
+    {
+        for (size_t c{}; c < m_image_data.size(); c++)
+        {
+            rows[c] = m_image_data[c].image_data.data()
+                + static_cast<size_t>(width) * y;
+        }
+        deinterleave_row(img + row_stride * y, channels, width, rows);
+    }
+}
+
 PSDStatus PSDRawImage::load(const unsigned char* img,
     ChannelOrder channel_order, int width, int height)
 {
     // Overwrite.
     if (!m_image_data.empty())
         m_image_data.clear();
+    m_generated = false;
+    m_fill_rows.clear();
+    m_tiles.clear();
 
     const std::vector<int> channels{ enumerate_channels(channel_order) };
 
@@ -45,33 +118,21 @@ PSDStatus PSDRawImage::load(const unsigned char* img,
     m_width = width;
     m_height = height;
 
-    // Read band-interleaved-by-pixel, store as band-sequential.
-    for (int c : channels)
-    {
-        m_image_data.push_back(PSDChannel());
-        m_image_data.back().compression = 0;
-        m_image_data.back().image_data.reserve(
-            static_cast<size_t>(width) * height);
-        for (int y{}; y < height; y++)
-        {
-            for (int x{}; x < width; x++)
-            {
-                m_image_data.back().image_data.push_back(
-                    img[get_index(m_channels, width, c, x, y)]);
-            }
-        }
-    }
+    deinterleave(img, channels, width, height);
 
     return PSDStatus::Success;
 }
 
-PSDStatus PSDRawImage::load(std::vector<PSDChannel> img, int channels,
-    int width, int height)
+PSDStatus PSDRawImage::load(const std::vector<PSDChannel>& img,
+    int channels, int width, int height)
 {
     m_channels = channels;
     m_width = width;
     m_height = height;
     m_image_data = img;
+    m_generated = false;
+    m_fill_rows.clear();
+    m_tiles.clear();
 
     return PSDStatus::Success;
 }
@@ -86,98 +147,467 @@ psdw::PSDStatus PSDRawImage::generate(int width, int height, PSDColour colour)
     m_width = width;
     m_height = height;
 
-    // Create background.
-    size_t elements{ static_cast<size_t>(width)
-        * static_cast<size_t>(height) };
-    std::vector<uint8_t> rgb{ colour.r, colour.g, colour.b };
+    /* Create background. Only a row of each colour is stored, and tiles are 
+    allocated as they are composited onto, so memory follows the layers. */
+    m_generated = true;
+    m_fill = colour;
+    m_fill_rows.clear();
+    for (uint8_t c : { colour.r, colour.g, colour.b })
+        m_fill_rows.emplace_back(static_cast<size_t>(width), c);
+    m_tiles_across = (width + tile_size - 1) / tile_size;
+    m_tiles_down = (height + tile_size - 1) / tile_size;
+    m_tiles.clear();
+    m_tiles.resize(static_cast<size_t>(m_channels) * m_tiles_across
+        * m_tiles_down);
 
-    for (uint8_t c : rgb)
+    return PSDStatus::Success;
+}
+
+const uint8_t* PSDRawImage::row(int channel, int y, uint8_t* buffer) const
+{
+    if (!m_generated)
     {
-        m_image_data.push_back({});
-        m_image_data.back().compression = 0;
-        m_image_data.back().image_data.reserve(elements);
-        for (size_t i{}; i < elements; i++)
-            m_image_data.back().image_data.push_back(c);
+        return m_image_data[channel].image_data.data()
+            + static_cast<size_t>(m_width) * y;
     }
 
-    return PSDStatus::Success;
+    // Rows crossing only untouched tiles are the fill row.
+    const size_t first{ tile_index(channel, 0, y) };
+    const auto tiles{ m_tiles.begin() + first };
+    if (std::all_of(tiles, tiles + m_tiles_across,
+        [](const std::vector<uint8_t>& tile) { return tile.empty(); }))
+    {
+        return m_fill_rows[channel].data();
+    }
+
+    const size_t tile_y{ static_cast<size_t>(y % tile_size) };
+    for (int x{}; x < m_width; x += tile_size)
+    {
+        const std::vector<uint8_t>& tile{ m_tiles[first + x / tile_size] };
+        const int span{ tile_width(x) };
+        std::memcpy(buffer + x, tile.empty() ? m_fill_rows[channel].data()
+            : tile.data() + tile_y * span, static_cast<size_t>(span));
+    }
+    return buffer;
 }
 
-void PSDRawImage::composite(const unsigned char* foreground,
-    psdw::PSDRect rect, psdw::PSDChannelOrder foreground_channel_order)
+uint8_t* PSDRawImage::writable_row(int channel, int x, int y)
 {
-    std::vector<int> fg_channels;
-    if (foreground_channel_order == psdw::PSDChannelOrder::BGRA)
-        fg_channels = { 2, 1, 0, 3 };
-    else
-        fg_channels = { 0, 1, 2, 3 };
+    if (!m_generated)
+    {
+        return m_image_data[channel].image_data.data()
+            + static_cast<size_t>(m_width) * y + x;
+    }
 
-    std::vector<int> bg_channels;
-    if (m_channels == 3)
-        bg_channels = { 0, 1, 2 };
-    else
-        bg_channels = { 1, 2, 3 };
+    std::vector<uint8_t>& tile{ m_tiles[tile_index(channel, x, y)] };
+    const int span{ tile_width(x) };
+    if (tile.empty())
+    {
+        const int tile_height{ std::min(tile_size,
+            m_height - y / tile_size * tile_size) };
+        tile.assign(static_cast<size_t>(span) * tile_height,
+            m_fill_rows[channel][0]);
+    }
+    return tile.data() + static_cast<size_t>(y % tile_size) * span
+        + x % tile_size;
+}
+
+size_t PSDRawImage::tile_index(int channel, int x, int y) const
+{
+    return (static_cast<size_t>(channel) * m_tiles_down + y / tile_size)
+        * m_tiles_across + x / tile_size;
+}
+
+int PSDRawImage::tile_width(int x) const
+{
+    return std::min(tile_size, m_width - x / tile_size * tile_size);
+}
+
+bool PSDRawImage::uniform() const
+{
+    // Tiles are allocated concurrently, so are checked rather than counted.
+    return m_generated && std::all_of(m_tiles.begin(), m_tiles.end(),
+        [](const std::vector<uint8_t>& tile) { return tile.empty(); });
+}
+
+struct PSDRawImage::LayerSource
+{
+    /* A ZIP channel, inflated a band at a time as the bands read it. Rows 
+    are kept only until their band is done, so just the bands in progress 
+    hold any. */
+    struct ZipChannel
+    {
+        explicit ZipChannel(const PSDChannel& channel)
+            : inflater{ channel.image_data.data(), channel.image_data.size() }
+        {
+        }
+
+        std::mutex mutex{};
+        PSDZip::Inflater inflater;
+        int next_band{}; // The next to inflate.
+        std::map<int, std::vector<uint8_t>> bands{};
+        std::vector<char> done{}; // By band, from the layer's first.
+    };
 
-    for (int y{}; y < rect.h; y++)
+    const PSDImage* image{};
+    int x{}, y{}; // Layer origin on the image.
+    int left{}, top{}, right{}, bottom{}; // Overlap, in image coordinates.
+    // Per channel, where each RLE row starts.
+    std::vector<size_t> offsets[4]{};
+    std::unique_ptr<ZipChannel> zip[4]{};
+};
+
+bool PSDRawImage::prepare_source(const PSDPendingLayer& layer, int width,
+    int height, LayerSource& source)
+{
+    const psdw::PSDRect& rect{ layer.rect };
+    const std::vector<PSDChannel>& channels{ layer.image->data() };
+    if (channels.size() != 4)
+        return false;
+
+    // As for a single layer, in 64 bits so distant layers can't overflow.
+    const int64_t left{ std::max<int64_t>(0, rect.x) };
+    const int64_t top{ std::max<int64_t>(0, rect.y) };
+    const int64_t right{ std::min<int64_t>(width,
+        static_cast<int64_t>(rect.x) + rect.w) };
+    const int64_t bottom{ std::min<int64_t>(height,
+        static_cast<int64_t>(rect.y) + rect.h) };
+    if (left >= right || top >= bottom)
+        return false;
+
+    source.image = layer.image;
+    source.x = rect.x;
+    source.y = rect.y;
+    source.left = static_cast<int>(left);
+    source.top = static_cast<int>(top);
+    source.right = static_cast<int>(right);
+    source.bottom = static_cast<int>(bottom);
+    for (size_t c{}; c < 4; c++)
     {
-        for (int x{}; x < rect.w; x++)
+        const PSDChannel& channel{ channels[c] };
+        if (channel.compression == 1)
+        {
+            std::vector<size_t>& offsets{ source.offsets[c] };
+            offsets.resize(channel.bytecounts.size() + 1);
+            for (size_t y{}; y < channel.bytecounts.size(); y++)
+                offsets[y + 1] = offsets[y] + channel.bytecounts[y];
+        }
+        else if (channel.compression == 2 || channel.compression == 3)
         {
-            // Basic implementation of alpha compositing.
-            int fg_channel_count{ static_cast<int>(fg_channels.size()) };
-            float fg_red{
-                static_cast<float>(
-                    foreground[get_index(
-                        fg_channel_count, rect.w,
-                        fg_channels[0], x, y)]) };
-            float fg_green{
-                static_cast<float>(
-                    foreground[get_index(
-                        fg_channel_count, rect.w,
-                        fg_channels[1], x, y)]) };
-            float fg_blue{
-                static_cast<float>(
-                    foreground[get_index(
-                        fg_channel_count, rect.w,
-                        fg_channels[2], x, y)]) };
-            float fg_alpha{
-                static_cast<float>(
-                    foreground[get_index(
-                        fg_channel_count, rect.w,
-                        fg_channels[3], x, y)]) };
-
-            fg_alpha *= 1.0f / 255; // Normalise 0 - 1.
-
-            size_t bg_index{ static_cast<size_t>(rect.y + y) * width()
-                + rect.x + x };
-
-            // If part of the foreground image extends off of the background,
-            // don't composite.
-            if (bg_index > width() * height()
-                || bg_index < 0
-                || rect.x + x >= width())
+            // Left for the bands to inflate.
+            source.zip[c] = std::make_unique<LayerSource::ZipChannel>(channel);
+            source.zip[c]->next_band = source.top / tile_size;
+            source.zip[c]->done.resize((source.bottom - 1) / tile_size
+                - source.top / tile_size + 1);
+        }
+    }
+
+    return true;
+}
+
+const uint8_t* PSDRawImage::inflate_band(const LayerSource& source,
+    int channel, int band)
+{
+    LayerSource::ZipChannel& zip{ *source.zip[channel] };
+    const PSDChannel& data{ source.image->data()[channel] };
+    const int width{ source.image->width() };
+    const int first_band{ source.top / tile_size };
+    std::lock_guard<std::mutex> lock{ zip.mutex };
+    for (; zip.next_band <= band; zip.next_band++)
+    {
+        /* Deflate has no row boundaries, so rows above the image are 
+        inflated only to be dropped, as are bands already done. */
+        std::vector<uint8_t> rows;
+        if (zip.next_band == first_band)
+        {
+            for (size_t skip{ static_cast<size_t>(source.top - source.y)
+                * width }; skip;)
             {
-                break;
+                rows.resize(std::min<size_t>(skip, 1 << 16));
+                if (!zip.inflater.read(rows.data(), rows.size()))
+                    break;
+                skip -= rows.size();
             }
-            
-            uint8_t new_red{
-                static_cast<uint8_t>(
-                    round(fg_red * fg_alpha
-                        + m_image_data[bg_channels[0]].image_data[bg_index]
-                        * (1.0f - fg_alpha))) };
-            uint8_t new_green{ 
-                static_cast<uint8_t>(
-                    round(fg_green * fg_alpha
-                        + m_image_data[bg_channels[1]].image_data[bg_index]
-                        * (1.0f - fg_alpha))) };
-            uint8_t new_blue{
-                static_cast<uint8_t>(
-                    round(fg_blue * fg_alpha
-                        + m_image_data[bg_channels[2]].image_data[bg_index]
-                        * (1.0f - fg_alpha))) };
-
-            m_image_data[bg_channels[0]].image_data[bg_index] = new_red;
-            m_image_data[bg_channels[1]].image_data[bg_index] = new_green;
-            m_image_data[bg_channels[2]].image_data[bg_index] = new_blue;
+        }
+        const int top{ std::max(zip.next_band * tile_size, source.top) };
+        const int bottom{ std::min((zip.next_band + 1) * tile_size,
+            source.bottom) };
+        rows.resize(static_cast<size_t>(bottom - top) * width);
+
+        // A channel that won't inflate is left transparent from there on.
+        const bool ok{ zip.inflater.read(rows.data(), rows.size()) };
+        if (zip.done[zip.next_band - first_band])
+            continue;
+        if (!ok)
+            std::fill(rows.begin(), rows.end(), uint8_t{});
+        else if (data.compression == 3)
+            PSDZip::unpredict(rows.data(), width, bottom - top);
+        zip.bands[zip.next_band] = std::move(rows);
+    }
+    return zip.bands[band].data();
+}
+
+void PSDRawImage::release_band(const LayerSource& source, int band)
+{
+    const int first_band{ source.top / tile_size };
+    for (const std::unique_ptr<LayerSource::ZipChannel>& zip : source.zip)
+    {
+        if (!zip)
+            continue;
+        std::lock_guard<std::mutex> lock{ zip->mutex };
+        zip->done[band - first_band] = 1;
+        zip->bands.erase(band);
+    }
+}
+
+const uint8_t* PSDRawImage::read_source_row(const LayerSource& source,
+    int channel, int y, uint8_t* buffer)
+{
+    const PSDChannel& data{ source.image->data()[channel] };
+    const int width{ source.image->width() };
+    const size_t row{ static_cast<size_t>(y - source.y) };
+    if (data.compression == 0)
+        return data.image_data.data() + row * width;
+
+    // A row that won't unpack is left transparent rather than read past.
+    const std::vector<size_t>& offsets{ source.offsets[channel] };
+    if (row + 1 >= offsets.size() || offsets[row + 1] > data.image_data.size()
+        || !PSDCompressedImage::unpack_row(data.image_data.data()
+            + offsets[row], offsets[row + 1] - offsets[row], width, buffer))
+    {
+        std::memset(buffer, 0, static_cast<size_t>(width));
+    }
+    return buffer;
+}
+
+void PSDRawImage::composite(const std::vector<PSDPendingLayer>& layers)
+{
+    // Nothing is inflated yet, so the bands can start straight away.
+    std::vector<LayerSource> sources;
+    sources.reserve(layers.size());
+    for (const PSDPendingLayer& layer : layers)
+    {
+        LayerSource source;
+        if (prepare_source(layer, width(), height(), source))
+            sources.push_back(std::move(source));
+    }
+    if (sources.empty())
+        return;
+
+    int top{ height() };
+    int bottom{};
+    for (const LayerSource& source : sources)
+    {
+        top = std::min(top, source.top);
+        bottom = std::max(bottom, source.bottom);
+    }
+
+    /* Bands a tile high share no tiles, so are composited concurrently. 
+    Rows don't depend on each other, so the result is the same however the 
+    bands are shared out. */
+    const int first_band{ top / tile_size };
+    const size_t bands{ static_cast<size_t>(
+        (bottom + tile_size - 1) / tile_size - first_band) };
+    parallel_for(bands, [&](size_t band)
+        {
+            const int band_top{ (first_band + static_cast<int>(band))
+                * tile_size };
+            composite_rows(sources, std::max(top, band_top),
+                std::min(bottom, band_top + tile_size));
+
+            // Drop the ZIP rows inflated for this band.
+            for (const LayerSource& source : sources)
+            {
+                if (source.top < band_top + tile_size
+                    && source.bottom > band_top)
+                {
+                    release_band(source, band_top / tile_size);
+                }
+            }
+        });
+}
+
+void PSDRawImage::composite_rows(const std::vector<LayerSource>& sources,
+    int top, int bottom)
+{
+    const int bg_channel{ m_channels == 3 ? 0 : 1 };
+    const int spans{ (width() + tile_size - 1) / tile_size };
+    // Stored layer channels are alpha, red, green then blue.
+    constexpr int alpha_channel{ 0 };
+
+    /* Rows of each layer are read once per image row, into buffers when 
+    they have to be unpacked. ZIP channels are inflated for the whole band 
+    on first read. */
+    std::vector<std::vector<uint8_t>> buffers(sources.size() * 4);
+    std::vector<const uint8_t*> rows(sources.size() * 4);
+    std::vector<int> row_read(sources.size() * 4);
+    std::vector<const uint8_t*> inflated(sources.size() * 4);
+    const int band{ top / tile_size };
+    // For each span, the lowest layer that shows through it.
+    std::vector<size_t> start(spans);
+    constexpr size_t undecided{ SIZE_MAX };
+
+    auto read = [&](size_t i, int c, int y)
+        {
+            const size_t index{ i * 4 + c };
+            if (row_read[index] != y + 1)
+            {
+                const LayerSource& source{ sources[i] };
+                const size_t width{ static_cast<size_t>(
+                    source.image->width()) };
+                if (source.zip[c])
+                {
+                    if (!inflated[index])
+                        inflated[index] = inflate_band(source, c, band);
+                    rows[index] = inflated[index] + width
+                        * (y - std::max(band * tile_size, source.top));
+                }
+                else
+                {
+                    std::vector<uint8_t>& buffer{ buffers[index] };
+                    buffer.resize(width);
+                    rows[index] = read_source_row(source, c, y, buffer.data());
+                }
+                row_read[index] = y + 1;
+            }
+            return rows[index];
+        };
+
+    for (int y{ top }; y < bottom; y++)
+    {
+        /* From the top down, find the layer opaque across each whole span, 
+        as nothing beneath it can show. */
+        std::fill(start.begin(), start.end(), undecided);
+        int remaining{ spans };
+        for (size_t i{ sources.size() }; i-- > 0 && remaining > 0;)
+        {
+            const LayerSource& source{ sources[i] };
+            if (y < source.top || y >= source.bottom)
+                continue;
+            const uint8_t* alpha{ nullptr };
+            for (int t{ (source.left + tile_size - 1) / tile_size };
+                t < spans; t++)
+            {
+                const int lo{ t * tile_size };
+                const int hi{ std::min(lo + tile_size, width()) };
+                if (hi > source.right)
+                    break;
+                if (start[t] != undecided)
+                    continue;
+                if (!alpha)
+                    alpha = read(i, alpha_channel, y);
+                if (std::all_of(alpha + (lo - source.x),
+                    alpha + (hi - source.x),
+                    [](uint8_t val) { return val == 255; }))
+                {
+                    start[t] = i;
+                    remaining--;
+                }
+            }
+        }
+        size_t first{ undecided };
+        for (size_t& index : start)
+        {
+            if (index == undecided)
+                index = 0;
+            first = std::min(first, index);
+        }
+
+        // Then blend each span from that layer up.
+        uint8_t* bg_rows[3]{};
+        for (size_t i{ first }; i < sources.size(); i++)
+        {
+            const LayerSource& source{ sources[i] };
+            if (y < source.top || y >= source.bottom)
+                continue;
+            for (int t{ source.left / tile_size };
+                t * tile_size < source.right; t++)
+            {
+                if (start[t] > i)
+                    continue;
+                const int lo{ std::max(t * tile_size, source.left) };
+                const int hi{ std::min((t + 1) * tile_size, source.right) };
+                const uint8_t* fg_rows[4]{};
+                for (int c{}; c < 3; c++)
+                    fg_rows[c] = read(i, c + 1, y) + (lo - source.x);
+                fg_rows[3] = read(i, alpha_channel, y) + (lo - source.x);
+
+                // Transparent spans leave their tiles untouched.
+                if (std::all_of(fg_rows[3], fg_rows[3] + (hi - lo),
+                    [](uint8_t val) { return val == 0; }))
+                {
+                    continue;
+                }
+
+                for (int c{}; c < 3; c++)
+                    bg_rows[c] = writable_row(bg_channel + c, lo, y);
+                blend_span(fg_rows, bg_rows, hi - lo);
+            }
+        }
+    }
+}
+
+void PSDRawImage::blend_span(const uint8_t* const* fg, uint8_t* const* bg,
+    int count)
+{
+    /* round(fg * alpha + bg * (1 - alpha)) with alpha normalised, in fixed 
+    point. Dividing by 255 with a bias and a shift rounds exactly, as the 
+    exact result is never a half. */
+    int x{};
+#if defined(PSDW_SSE2)
+    const __m128i zero{ _mm_setzero_si128() };
+    const __m128i opaque{ _mm_set1_epi8(static_cast<char>(0xff)) };
+    const __m128i max{ _mm_set1_epi16(255) };
+    const __m128i bias{ _mm_set1_epi16(128) };
+    for (; x + 16 <= count; x += 16)
+    {
+        const __m128i alpha{ _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(fg[3] + x)) };
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(alpha, zero)) == 0xffff)
+            continue;
+        const bool solid{
+            _mm_movemask_epi8(_mm_cmpeq_epi8(alpha, opaque)) == 0xffff };
+
+        const __m128i alpha_lo{ _mm_unpacklo_epi8(alpha, zero) };
+        const __m128i alpha_hi{ _mm_unpackhi_epi8(alpha, zero) };
+        const __m128i inverse_lo{ _mm_sub_epi16(max, alpha_lo) };
+        const __m128i inverse_hi{ _mm_sub_epi16(max, alpha_hi) };
+        for (int c{}; c < 3; c++)
+        {
+            const __m128i src{ _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(fg[c] + x)) };
+            __m128i* dst{ reinterpret_cast<__m128i*>(bg[c] + x) };
+            if (solid)
+            {
+                _mm_storeu_si128(dst, src);
+                continue;
+            }
+            const __m128i dst_val{ _mm_loadu_si128(dst) };
+            // The sums fit in 16 bits, so wrapping products are fine.
+            __m128i lo{ _mm_add_epi16(_mm_add_epi16(
+                _mm_mullo_epi16(_mm_unpacklo_epi8(src, zero), alpha_lo),
+                _mm_mullo_epi16(_mm_unpacklo_epi8(dst_val, zero), inverse_lo)),
+                bias) };
+            __m128i hi{ _mm_add_epi16(_mm_add_epi16(
+                _mm_mullo_epi16(_mm_unpackhi_epi8(src, zero), alpha_hi),
+                _mm_mullo_epi16(_mm_unpackhi_epi8(dst_val, zero), inverse_hi)),
+                bias) };
+            lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+            hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+            _mm_storeu_si128(dst, _mm_packus_epi16(lo, hi));
+        }
+    }
+#endif
+    for (; x < count; x++)
+    {
+        const unsigned alpha{ fg[3][x] };
+        if (alpha == 0)
+            continue;
+        for (int c{}; c < 3; c++)
+        {
+            const unsigned sum{ fg[c][x] * alpha + bg[c][x] * (255 - alpha)
+                + 128 };
+            bg[c][x] = static_cast<uint8_t>((sum + (sum >> 8)) >> 8);
         }
     }
 }
@@ -188,162 +618,620 @@ PSDStatus PSDCompressedImage::load(const unsigned char* img,
     // Overwrite.
     if (!m_image_data.empty())
         m_image_data.clear();
-    
-    // An attempt to replicate Photoshop's implementation of PackBits.
+    m_shared_data.reset();
+
     const std::vector<int> channels{ enumerate_channels(channel_order) };
 
     m_channels = static_cast<int>(channels.size());
     m_width = width;
     m_height = height;
-    
-    enum class State
+
+    if (m_compression == PSDCompression::ZIP
+        || m_compression == PSDCompression::ZIPPrediction)
     {
-        Repeat,
-        Literal
-    };
+        deinterleave(img, channels, width, height);
+        deflate_channels(m_compression == PSDCompression::ZIPPrediction);
+        return PSDStatus::Success;
+    }
 
-    State state{ State::Repeat };
-    constexpr int max_run{ 128 };
+    /* Convert band-interleaved-by-pixel to band sequential in a single pass.
+    Each row is split into contiguous channel rows, which are packed straight
+    into their channels. */
+    const size_t row_stride{ static_cast<size_t>(width) * m_channels };
+    m_image_data.resize(channels.size());
+    for (PSDChannel& channel : m_image_data)
+        channel.compression = 1;
+    if (m_compression == PSDCompression::Auto)
+        choose_compression(img, channels);
+    pack_bands([&](int y, uint8_t* const* buffers, const uint8_t**)
+        {
+            deinterleave_row(img + row_stride * y, channels, width, buffers);
+        });
+
+    // If a sample was misleading, fall back to raw data.
+    if (m_compression == PSDCompression::Auto)
+    {
+        const size_t raw_length{ static_cast<size_t>(width) * height };
+        for (size_t c{}; c < m_image_data.size(); c++)
+        {
+            PSDChannel& channel{ m_image_data[c] };
+            if (channel.compression == 0 || !inflated(channel))
+                continue;
+            channel.compression = 0;
+            channel.bytecounts.clear();
+            channel.bytecounts.shrink_to_fit();
+            channel.image_data.resize(raw_length);
+            const unsigned char* src{ img + channels[c] };
+            for (size_t i{}; i < raw_length; i++)
+                channel.image_data[i] = src[i * m_channels];
+        }
+    }
+
+    return PSDStatus::Success;
+}
+
+PSDStatus PSDCompressedImage::load(const std::vector<PSDChannel>& img,
+    int channels, int width, int height)
+{
+    // Confirm correct number of channels.
+    if (img.size() != 3)
+        return PSDStatus::InvalidArgument;
+    // Confirm this isn't already compressed.
+    if (!img[0].bytecounts.empty())
+        return PSDStatus::InvalidArgument;
 
-    std::vector<uint8_t> buffer{};
-    buffer.reserve(max_run);
+    return load_planes(channels, width, height, [&](int c, int y, uint8_t*)
+        {
+            return img[c].image_data.data() + static_cast<size_t>(width) * y;
+        });
+}
 
-    // Convert band-interleaved-by-pixel to band sequential.
-    for (int c : channels)
+PSDStatus PSDCompressedImage::load(const PSDRawImage& img)
+{
+    // A background nothing has been composited onto packs analytically.
+    if (img.uniform() && (m_compression == PSDCompression::RLE
+        || m_compression == PSDCompression::RLEOptimal))
     {
-        m_image_data.push_back(PSDChannel());
-        m_image_data.back().compression = 1;
-        m_image_data.back().image_data.reserve(
-            static_cast<size_t>(width) * height);
-        m_image_data.back().bytecounts.reserve(height);
-        for (int y{}; y < height; y++)
+        return generate(img.width(), img.height(), img.fill());
+    }
+
+    return load_planes(img.channels(), img.width(), img.height(),
+        [&](int c, int y, uint8_t* buffer) { return img.row(c, y, buffer); });
+}
+
+template <typename ReadRow>
+PSDStatus PSDCompressedImage::load_planes(int channels, int width,
+    int height, ReadRow&& read_row)
+{
+    // Overwrite.
+    if (!m_image_data.empty())
+        m_image_data.clear();
+    m_shared_data.reset();
+
+    m_channels = channels;
+    m_width = width;
+    m_height = height;
+    m_image_data.resize(channels);
+
+    if (m_compression == PSDCompression::ZIP
+        || m_compression == PSDCompression::ZIPPrediction)
+    {
+        for (int c{}; c < channels; c++)
         {
-            uint16_t row_bytecount{ 0 };
-            int run{ 0 };
-            int run_group{ 0 };
-            for (int x{}; x < width; x++)
+            std::vector<uint8_t>& plane{ m_image_data[c].image_data };
+            plane.resize(static_cast<size_t>(width) * height);
+            for (int y{}; y < height; y++)
             {
-                // Move x to the end of a run and count its length.
-                for (int r{ x };
-                    img[get_index(m_channels, width, c, r, y)]
-                    == img[get_index(m_channels, width, c, x, y)]
-                    && r < width
-                    && run <= max_run
-                    && run_group < max_run;
-                    r++)
-                {
-                    run++;
-                    run_group++;
-                    x = r;
-                }
+                uint8_t* dst{ plane.data() + static_cast<size_t>(width) * y };
+                const uint8_t* src{ read_row(c, y, dst) };
+                if (src != dst)
+                    std::memcpy(dst, src, static_cast<size_t>(width));
+            }
+        }
+        deflate_channels(m_compression == PSDCompression::ZIPPrediction);
+        return PSDStatus::Success;
+    }
 
-                uint8_t current_val{
-                    img[get_index(m_channels, width, c, x, y)] };
-                if (run >= 3)
+    // The planes are already band sequential, so are packed where they are.
+    for (PSDChannel& channel : m_image_data)
+        channel.compression = 1;
+    pack_bands([&](int y, uint8_t* const* buffers, const uint8_t** rows)
+        {
+            for (int c{}; c < channels; c++)
+                rows[c] = read_row(c, y, buffers[c]);
+        });
+
+    // Without a sample to go on, Auto keeps whichever is smaller.
+    if (m_compression == PSDCompression::Auto)
+    {
+        for (int c{}; c < channels; c++)
+        {
+            PSDChannel& channel{ m_image_data[c] };
+            if (!inflated(channel))
+                continue;
+            channel.compression = 0;
+            channel.bytecounts.clear();
+            channel.bytecounts.shrink_to_fit();
+            channel.image_data.resize(static_cast<size_t>(width) * height);
+            for (int y{}; y < height; y++)
+            {
+                uint8_t* dst{ channel.image_data.data()
+                    + static_cast<size_t>(width) * y };
+                const uint8_t* src{ read_row(c, y, dst) };
+                if (src != dst)
+                    std::memcpy(dst, src, static_cast<size_t>(width));
+            }
+        }
+    }
+
+    return PSDStatus::Success;
+}
+
+template <typename ReadRow>
+void PSDCompressedImage::pack_bands(ReadRow&& read_row)
+{
+    const int width{ m_width };
+    const int height{ m_height };
+    const size_t max_row_length{ max_packed_length(width) };
+    for (PSDChannel& channel : m_image_data)
+    {
+        if (channel.compression == 1)
+            channel.bytecounts.resize(height);
+        else
+            channel.image_data.resize(static_cast<size_t>(width) * height);
+    }
+
+    /* Rows are independent, so bands of them are packed concurrently, each 
+    into scratch sized for its own worst case, and kept at their packed 
+    length until they are joined. */
+    const size_t channel_count{ m_image_data.size() };
+    const size_t row_stride{ static_cast<size_t>(width) * channel_count };
+    const int band_rows{ static_cast<int>(std::max<size_t>(1,
+        band_size / std::max<size_t>(1, row_stride))) };
+    const size_t bands{ static_cast<size_t>((height + band_rows - 1)
+        / band_rows) };
+    const bool optimal{ m_compression == PSDCompression::RLEOptimal };
+    std::vector<std::vector<uint8_t>> band_data(bands * channel_count);
+    std::vector<uint64_t> band_savings(bands);
+    parallel_for(bands, [&](size_t band)
+        {
+            const int first_row{ static_cast<int>(band) * band_rows };
+            const int last_row{ std::min(height, first_row + band_rows) };
+            std::vector<uint8_t> row_data(row_stride);
+            // Optimal packing is compared against Photoshop's.
+            std::vector<uint8_t> greedy(optimal ? max_row_length : 0);
+            std::vector<int> scratch{};
+            // Uniform rows always pack the same way, so are copied.
+            std::vector<std::vector<uint8_t>> uniform_rows(channel_count);
+            uint8_t* buffers[4]{};
+            const uint8_t* rows[4]{};
+            std::vector<uint8_t> packed_rows[4]{};
+            size_t lengths[4]{};
+            for (size_t c{}; c < channel_count; c++)
+            {
+                if (m_image_data[c].compression == 1)
+                    packed_rows[c].resize(max_row_length
+                        * (last_row - first_row));
+            }
+
+            for (int y{ first_row }; y < last_row; y++)
+            {
+                // Raw channels are read straight into place.
+                for (size_t c{}; c < channel_count; c++)
                 {
-                    // Always treat runs over two as repeat runs.
-                    if (state == State::Repeat)
-                    {
-                        finalise_pack(buffer, row_bytecount);
-                        finalise_pack(current_val, run, row_bytecount);
-                    }
-                    else
-                    {
-                        finalise_pack(buffer, row_bytecount);
-                        finalise_pack(current_val, run, row_bytecount);
-                        state = State::Repeat;
-                    }
+                    buffers[c] = m_image_data[c].compression == 0
+                        ? m_image_data[c].image_data.data()
+                            + static_cast<size_t>(width) * y
+                        : row_data.data() + static_cast<size_t>(width) * c;
+                    rows[c] = buffers[c];
                 }
-                else if (run == 2)
+                read_row(y, buffers, rows);
+                for (size_t c{}; c < channel_count; c++)
                 {
-                    // If the last run was a repeat, treat runs of two as
-                    // a repeat, otherwise add to the last literal run.
-                    if (state == State::Repeat)
+                    PSDChannel& channel{ m_image_data[c] };
+                    if (channel.compression == 0)
+                        continue;
+                    uint8_t* out{ packed_rows[c].data() + lengths[c] };
+                    size_t row_length{};
+                    if (rows[c][width - 1] == rows[c][0]
+                        && find_run_end(rows[c], 0, width) == width)
                     {
-                        finalise_pack(buffer, row_bytecount);
-                        finalise_pack(current_val, run, row_bytecount);
+                        std::vector<uint8_t>& packed{ uniform_rows[c] };
+                        if (packed.empty() || packed[1] != rows[c][0])
+                            packed = pack_uniform_row(rows[c][0], width);
+                        std::memcpy(out, packed.data(), packed.size());
+                        row_length = packed.size();
                     }
-                    else
-                    {
-                        for (int r{}; r < run; r++)
-                            buffer.push_back(current_val);
-                    }
-                }
-                else
-                {
-                    // Always treat runs of one as a literal.
-                    if (state == State::Repeat)
+                    else if (optimal)
                     {
-                        buffer.push_back(current_val);
-                        state = State::Literal;
+                        row_length = pack_row_optimal(rows[c], width, out,
+                            scratch);
+                        band_savings[band] += pack_row(rows[c], width,
+                            greedy.data()) - row_length;
                     }
                     else
                     {
-                        buffer.push_back(current_val);
+                        row_length = pack_row(rows[c], width, out);
                     }
+                    channel.bytecounts[y] = static_cast<uint32_t>(row_length);
+                    lengths[c] += row_length;
                 }
-
-                if (run_group >= max_run)
-                {
-                    finalise_pack(buffer, row_bytecount);
-                    run_group = 0;
-                    state = State::Repeat;
-                }
-                run = 0;
             }
-            finalise_pack(buffer, row_bytecount);
-            m_image_data.back().bytecounts.push_back(row_bytecount);
-            state = State::Repeat;
+            for (size_t c{}; c < channel_count; c++)
+            {
+                band_data[band * channel_count + c].assign(
+                    packed_rows[c].begin(), packed_rows[c].begin()
+                        + static_cast<ptrdiff_t>(lengths[c]));
+            }
+        });
+
+    // Join the bands into channels of exactly their packed length.
+    for (size_t c{}; c < channel_count; c++)
+    {
+        if (m_image_data[c].compression == 0)
+            continue;
+        size_t length{};
+        for (size_t band{}; band < bands; band++)
+            length += band_data[band * channel_count + c].size();
+        std::vector<uint8_t>& image_data{ m_image_data[c].image_data };
+        image_data.reserve(length);
+        for (size_t band{}; band < bands; band++)
+        {
+            std::vector<uint8_t>& data{ band_data[band * channel_count + c] };
+            image_data.insert(image_data.end(), data.begin(), data.end());
+            std::vector<uint8_t>().swap(data);
         }
     }
+    m_savings = 0;
+    for (uint64_t saving : band_savings)
+        m_savings += saving;
+}
+
+psdw::PSDStatus PSDCompressedImage::generate(int width, int height,
+    PSDColour colour)
+{
+    // Overwrite.
+    if (!m_image_data.empty())
+        m_image_data.clear();
+
+    m_channels = 3;
+    m_width = width;
+    m_height = height;
+    m_savings = 0;
+
+    // Documents tend to share a size and background, so the channels are too.
+    using Key = std::tuple<int, int, uint8_t, uint8_t, uint8_t>;
+    static std::mutex cache_mutex;
+    static std::map<Key, std::weak_ptr<const std::vector<PSDChannel>>> cache;
+    const Key key{ width, height, colour.r, colour.g, colour.b };
+    {
+        std::lock_guard<std::mutex> lock{ cache_mutex };
+        auto found{ cache.find(key) };
+        if (found != cache.end())
+            m_shared_data = found->second.lock();
+    }
+    if (m_shared_data)
+        return PSDStatus::Success;
+
+    /* Every row of a single colour packs the same way, so each channel is
+    one packed row, repeated by doubling copies. */
+    auto channels{ std::make_shared<std::vector<PSDChannel>>() };
+    for (uint8_t c : { colour.r, colour.g, colour.b })
+    {
+        const std::vector<uint8_t> packed{ pack_uniform_row(c, width) };
+        const size_t length{ packed.size() * height };
+        PSDChannel& channel{ channels->emplace_back() };
+        channel.compression = 1;
+        channel.bytecounts.assign(height, static_cast<uint32_t>(packed.size()));
+        channel.image_data.resize(length);
+        uint8_t* image_data{ channel.image_data.data() };
+        std::memcpy(image_data, packed.data(), packed.size());
+        for (size_t filled{ packed.size() }; filled < length;)
+        {
+            size_t count{ std::min(filled, length - filled) };
+            std::memcpy(image_data + filled, image_data, count);
+            filled += count;
+        }
+    }
+    m_shared_data = channels;
+
+    std::lock_guard<std::mutex> lock{ cache_mutex };
+    std::erase_if(cache, [](const auto& entry) { return entry.second.expired(); });
+    cache[key] = m_shared_data;
 
     return PSDStatus::Success;
 }
 
-PSDStatus PSDCompressedImage::load(std::vector<PSDChannel> img, int channels,
-    int width, int height)
+std::vector<uint8_t> PSDCompressedImage::pack_uniform_row(uint8_t val,
+    int width)
 {
-    // Confirm correct number of channels.
-    if (img.size() != 3)
-        return PSDStatus::InvalidArgument;
-    // Confirm this isn't already compressed.
-    if (!img[0].bytecounts.empty())
-        return PSDStatus::InvalidArgument;
+    // Full groups repeat 128 times, and a lone byte at the end is a literal.
+    std::vector<uint8_t> packed;
+    packed.reserve(max_packed_length(width));
+    for (int group{}; group < width; group += 128)
+    {
+        int length{ std::min(128, width - group) };
+        packed.push_back(static_cast<uint8_t>(length == 1 ? 0 : 1 - length));
+        packed.push_back(val);
+    }
+    return packed;
+}
 
-    // Convert PSDRawImage into temporary flat BIP array.
-    std::vector<uint8_t> flat_img;
-    for (int i{}; i < width * height; i++)
+bool PSDCompressedImage::inflated(const PSDChannel& channel) const
+{
+    return channel.image_data.size() + channel.bytecounts.size()
+        * m_bytecount_size >= static_cast<size_t>(m_width) * m_height;
+}
+
+void PSDCompressedImage::choose_compression(const unsigned char* img,
+    const std::vector<int>& channels)
+{
+    /* Pack an evenly spaced sample of rows, and only use RLE for channels
+    where it saves space, counting the bytecounts it needs. */
+    const int samples{ std::min(m_height, sample_rows) };
+    const size_t row_stride{ static_cast<size_t>(m_width) * m_channels };
+    std::vector<uint8_t> row_data(row_stride);
+    std::vector<uint8_t> packed(max_packed_length(m_width));
+    uint8_t* rows[4]{};
+    for (size_t c{}; c < channels.size(); c++)
+        rows[c] = row_data.data() + static_cast<size_t>(m_width) * c;
+
+    std::vector<size_t> packed_lengths(channels.size());
+    for (int i{}; i < samples; i++)
     {
-        flat_img.push_back(img.data()[0].image_data[i]);
-        flat_img.push_back(img.data()[1].image_data[i]);
-        flat_img.push_back(img.data()[2].image_data[i]);
+        int y{ static_cast<int>(static_cast<int64_t>(i) * m_height / samples) };
+        deinterleave_row(img + row_stride * y, channels, m_width, rows);
+        for (size_t c{}; c < channels.size(); c++)
+        {
+            packed_lengths[c] += pack_row(rows[c], m_width, packed.data())
+                + m_bytecount_size;
+        }
     }
 
-    // Load conventionally.
-    PSDStatus status = load(flat_img.data(), ChannelOrder::RGB,
-        width, height);
+    const size_t raw_length{ static_cast<size_t>(m_width) * samples };
+    for (size_t c{}; c < channels.size(); c++)
+        m_image_data[c].compression = packed_lengths[c] < raw_length ? 1 : 0;
+}
+
+void PSDCompressedImage::deflate_channels(bool prediction)
+{
+    // Channels are independent streams, so each is deflated on its own core.
+    parallel_for(m_image_data.size(), [&](size_t c)
+        {
+            PSDChannel& channel{ m_image_data[c] };
+            if (prediction)
+                PSDZip::predict(channel.image_data.data(), m_width, m_height);
+            channel.image_data = PSDZip::compress(channel.image_data.data(),
+                channel.image_data.size(), m_zip_level);
+            channel.compression = prediction ? 3 : 2;
+        });
+}
+
+size_t PSDCompressedImage::pack_row(const uint8_t* row, int width,
+    uint8_t* out)
+{
+    /* An attempt to replicate Photoshop's implementation of PackBits. Runs 
+    never cross a 128 byte group. Within a group, runs of two or more are 
+    repeated, unless a literal is being built, in which case only a run of 
+    three or more will end it. */
+    constexpr int max_run{ 128 };
 
-    return status;
+    uint8_t* dst{ out };
+    for (int group{}; group < width; group += max_run)
+    {
+        const int end{ std::min(group + max_run, width) };
+        int x{ group };
+        while (x < end)
+        {
+            int run_end{ find_run_end(row, x, end) };
+            if (run_end - x >= 2)
+            {
+                *dst++ = static_cast<uint8_t>(1 - (run_end - x));
+                *dst++ = row[x];
+                x = run_end;
+                continue;
+            }
+
+            // A single byte starts a literal run.
+            int literal_end{ find_triple(row, x, end) };
+            *dst++ = static_cast<uint8_t>(literal_end - x - 1);
+            std::memcpy(dst, row + x, static_cast<size_t>(literal_end - x));
+            dst += literal_end - x;
+            x = literal_end;
+        }
+    }
+
+    return static_cast<size_t>(dst - out);
 }
 
-void PSDCompressedImage::finalise_pack(std::vector<uint8_t>& buf, uint16_t& bytes)
+size_t PSDCompressedImage::pack_row_optimal(const uint8_t* row, int width,
+    uint8_t* out, std::vector<int>& scratch)
 {
-    // For literal bytes.
-    if (buf.empty())
-        return;
-    bytes += 1 + static_cast<uint16_t>(buf.size());
-    m_image_data.back().image_data.push_back(
-        static_cast<uint8_t>(buf.size() - 1));
-    m_image_data.back().image_data.insert(
-        m_image_data.back().image_data.end(),
-        buf.begin(), buf.end());
-    buf.clear();
-}
-
-void PSDCompressedImage::finalise_pack(const uint8_t val, int& reps, uint16_t& bytes)
-{
-    // For repeated bytes.
-    m_image_data.back().image_data.push_back(reps * -1 + 1);
-    m_image_data.back().image_data.push_back(val);
-    bytes += 2;
-}
\ No newline at end of file
+    /* Dynamic programming over prefixes of the row. cost[i] is the fewest
+    bytes that encode the first i bytes, and from[i] is where the last run of
+    that encoding starts. Shortening the last run never costs more, so cost 
+    never decreases with i. The cheapest repeat ending at i therefore starts
+    as early as the run of equal bytes and the 128 byte limit allow, and the
+    cheapest literal minimises cost[j] - j over the last 128 starts, which a 
+    monotonic queue tracks. */
+    constexpr int max_run{ 128 };
+    const size_t entries{ static_cast<size_t>(width) + 1 };
+    scratch.resize(entries * 3);
+    int* cost{ scratch.data() };
+    int* from{ cost + entries };
+    int* queue{ from + entries };
+    int head{}, tail{};
+    int run_start{};
+
+    cost[0] = 0;
+    for (int i{ 1 }; i <= width; i++)
+    {
+        const int j{ i - 1 };
+        while (tail > head
+            && cost[queue[tail - 1]] - queue[tail - 1] >= cost[j] - j)
+        {
+            tail--;
+        }
+        queue[tail++] = j;
+        while (queue[head] < i - max_run)
+            head++;
+        int best_from{ queue[head] };
+        int best{ cost[best_from] + 1 + (i - best_from) };
+
+        if (j == 0 || row[j] != row[j - 1])
+            run_start = j;
+        const int start{ std::max(run_start, i - max_run) };
+        if (i - start >= 2 && cost[start] + 2 < best)
+        {
+            best = cost[start] + 2;
+            best_from = start;
+        }
+        cost[i] = best;
+        from[i] = best_from;
+    }
+
+    // Walk back through the runs, then write them out forwards.
+    int runs{};
+    for (int i{ width }; i > 0; i = from[i])
+        queue[runs++] = i;
+    uint8_t* dst{ out };
+    int start{};
+    for (int r{ runs - 1 }; r >= 0; r--)
+    {
+        const int end{ queue[r] };
+        const int length{ end - start };
+        // Only a repeat covers two or more bytes for two bytes.
+        if (length >= 2 && cost[end] - cost[start] == 2)
+        {
+            *dst++ = static_cast<uint8_t>(1 - length);
+            *dst++ = row[start];
+        }
+        else
+        {
+            *dst++ = static_cast<uint8_t>(length - 1);
+            std::memcpy(dst, row + start, static_cast<size_t>(length));
+            dst += length;
+        }
+        start = end;
+    }
+
+    return static_cast<size_t>(dst - out);
+}
+
+int PSDCompressedImage::find_run_end(const uint8_t* row, int start, int end)
+{
+    const uint8_t val{ row[start] };
+    int x{ start + 1 };
+#ifdef PSDW_AVX2
+    const __m256i val_256{ _mm256_set1_epi8(static_cast<char>(val)) };
+    while (x + 32 <= end)
+    {
+        uint32_t different{ ~static_cast<uint32_t>(_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256(
+                reinterpret_cast<const __m256i*>(row + x)), val_256))) };
+        if (different)
+            return x + std::countr_zero(different);
+        x += 32;
+    }
+#endif
+#ifdef PSDW_SSE2
+    const __m128i val_128{ _mm_set1_epi8(static_cast<char>(val)) };
+    while (x + 16 <= end)
+    {
+        uint32_t different{ ~static_cast<uint32_t>(_mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(row + x)), val_128)))
+            & 0xffff };
+        if (different)
+            return x + std::countr_zero(different);
+        x += 16;
+    }
+#endif
+    while (x < end && row[x] == val)
+        x++;
+
+    return x;
+}
+
+int PSDCompressedImage::find_triple(const uint8_t* row, int start, int end)
+{
+    // Loads are offset by up to 2 bytes, so must stop 2 bytes short of end.
+    int x{ start };
+#ifdef PSDW_AVX2
+    while (x + 34 <= end)
+    {
+        const uint8_t* p{ row + x };
+        __m256i a{ _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)) };
+        __m256i b{ _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 1)) };
+        __m256i c{ _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 2)) };
+        uint32_t triples{ static_cast<uint32_t>(_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, b),
+                _mm256_cmpeq_epi8(b, c)))) };
+        if (triples)
+            return x + std::countr_zero(triples);
+        x += 32;
+    }
+#endif
+#ifdef PSDW_SSE2
+    while (x + 18 <= end)
+    {
+        const uint8_t* p{ row + x };
+        __m128i a{ _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)) };
+        __m128i b{ _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 1)) };
+        __m128i c{ _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 2)) };
+        uint32_t triples{ static_cast<uint32_t>(_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a, b), _mm_cmpeq_epi8(b, c)))) };
+        if (triples)
+            return x + std::countr_zero(triples);
+        x += 16;
+    }
+#endif
+    while (x + 2 < end)
+    {
+        if (row[x] == row[x + 1] && row[x + 1] == row[x + 2])
+            return x;
+        x++;
+    }
+
+    return end;
+}
+
+bool PSDCompressedImage::unpack_row(const uint8_t* packed, size_t length,
+    int width, uint8_t* out)
+{
+    size_t i{};
+    int x{};
+    while (i < length && x < width)
+    {
+        const int header{ static_cast<int8_t>(packed[i++]) };
+        if (header >= 0)
+        {
+            // A literal run of header + 1 bytes.
+            const int count{ header + 1 };
+            if (i + count > length || x + count > width)
+                return false;
+            std::memcpy(out + x, packed + i, static_cast<size_t>(count));
+            i += count;
+            x += count;
+        }
+        else if (header != -128)
+        {
+            // A repeated run of 1 - header bytes. -128 is a no-op.
+            const int count{ 1 - header };
+            if (i >= length || x + count > width)
+                return false;
+            std::memset(out + x, packed[i++], static_cast<size_t>(count));
+            x += count;
+        }
+    }
+
+    return x == width;
+}
+
+size_t PSDCompressedImage::max_packed_length(int width)
+{
+    /* Literal runs cost one extra byte, but a run can only be broken early by
+    a repeat of three or more, which saves at least as much. So the worst 
+    case is one extra byte for every group of 128 bytes. */
+    return static_cast<size_t>(width) + (static_cast<size_t>(width) + 127) / 128;
+}
@@ -0,0 +1,174 @@
+// Copyright (c) 2024 Dan Kemp. All rights reserved.
+// This source code is licensed under the MIT license found in the 
+// LICENSE file in the root directory of this source tree.
+
+#include "psdlayout.hpp"
+#include "psddata.hpp"
+#include "psdimage.hpp"
+#include "psdtypes.hpp"
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+using namespace psdw;
+using namespace psdimpl;
+
+PSDLayout::PSDLayout(const PSDData& psd_data, uint64_t merged_data_length)
+{
+    bool fits_psd{ fits_psd_dimensions(psd_data) };
+    format = psd_data.format;
+    if (format == PSDFormat::Auto)
+        format = fits_psd ? PSDFormat::PSD : PSDFormat::PSB;
+
+    plan(psd_data, merged_data_length);
+
+    // The size is only known once planned, so try again if it's too big.
+    if (format == PSDFormat::PSD && file_size >= max_psd_file_size)
+    {
+        if (psd_data.format == PSDFormat::Auto)
+        {
+            format = PSDFormat::PSB;
+            plan(psd_data, merged_data_length);
+        }
+        else
+        {
+            within_limits = false;
+        }
+    }
+    if (format == PSDFormat::PSD && !fits_psd)
+        within_limits = false;
+}
+
+PSDLayout::PSDLayout(const PSDData& psd_data, uint64_t merged_data_length,
+    PSDFormat planned_format)
+    : format{ planned_format }
+{
+    plan(psd_data, merged_data_length);
+}
+
+void PSDLayout::plan(const PSDData& psd_data, uint64_t merged_data_length)
+{
+    const LayerAndMaskInfo& lmi{ psd_data.layer_and_mask_info };
+    uint32_t prefix_length{ 12 };
+
+    colour_mode_data_offset = psd_data.header.length();
+    image_resources_offset = colour_mode_data_offset
+        + psd_data.colour_mode_data.length();
+    image_resources_length = psd_data.image_resources.length();
+    layer_and_mask_info_offset = image_resources_offset
+        + sizeof(image_resources_length) + image_resources_length;
+
+    // Layer records follow the two length fields and the layer count.
+    uint64_t offset{ layer_and_mask_info_offset + length_size() * 2
+        + sizeof(lmi.layer_count()) };
+    layers.clear();
+    layers.reserve(lmi.layer_records.size());
+    for (const LayerRecord& record : lmi.layer_records)
+    {
+        layers.push_back({});
+        layers.back().record_offset = offset;
+        layers.back().extra_data_length = record.extra_data_length();
+        layers.back().record_length = record.length() + static_cast<uint32_t>(
+            (length_size() - sizeof(uint32_t)) * record.channel_count);
+        offset += layers.back().record_length;
+    }
+
+    // Channel image data is stored in the same order as the records.
+    channel_data_offset = offset;
+    for (size_t i{}; i < layers.size(); ++i)
+    {
+        const LayerRecord& record{ lmi.layer_records[i] };
+        const std::vector<PSDChannel>& channels{
+            lmi.layer_image_data[i]->data() };
+        std::vector<int16_t> ids{ record.red_channel_info.id,
+            record.green_channel_info.id, record.blue_channel_info.id };
+        if (record.channel_count == 4)
+            ids.insert(ids.begin(), record.alpha_channel_info.id);
+
+        for (size_t c{}; c < channels.size() && c < ids.size(); ++c)
+        {
+            uint64_t length{ sizeof(channels[c].compression)
+                + channels[c].bytecounts.size() * bytecount_size()
+                + channels[c].image_data.size() };
+            layers[i].channels.push_back({ ids[c], offset, length });
+            offset += length;
+        }
+    }
+    channel_data_length = offset - channel_data_offset;
+    offset += sizeof(lmi.mystery_null);
+
+    layer_info_length = offset - layer_and_mask_info_offset
+        - length_size() * 2;
+
+    offset += lmi.global_layer_mask_info.length();
+    offset += lmi.patterns.length() + prefix_length;
+    // In a PSB, the filter mask has an 8 byte length.
+    offset += lmi.filter_mask.length() + prefix_length - sizeof(uint32_t)
+        + length_size();
+    offset += lmi.compositor_info.length() + prefix_length;
+
+    layer_and_mask_info_length = offset - layer_and_mask_info_offset
+        - length_size();
+
+    // Merged image data shares one compression field between all channels.
+    const PSDRawImage& merged_image{ psd_data.image_data };
+    image_data_offset = offset;
+    image_data_length = sizeof(uint16_t) + static_cast<uint64_t>(
+        merged_image.channels()) * merged_image.height() * bytecount_size()
+        + merged_data_length;
+
+    file_size = image_data_offset + image_data_length;
+}
+
+bool PSDLayout::fits_psd_dimensions(const PSDData& psd_data)
+{
+    if (psd_data.header.width > max_psd_dimension
+        || psd_data.header.height > max_psd_dimension)
+    {
+        return false;
+    }
+
+    // Wider layers would overflow 16 bit bytecounts.
+    for (const LayerRecord& record : psd_data.layer_and_mask_info.layer_records)
+    {
+        const LayerRect& rect{ record.layer_content_rect };
+        if (rect.right - rect.left > max_psd_dimension
+            || rect.bottom - rect.top > max_psd_dimension)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+uint64_t PSDLayout::min_merged_data_length(int channels, int width,
+    int height)
+{
+    // Each group of up to 128 bytes packs to at least a length and a value.
+    return static_cast<uint64_t>(channels) * height
+        * ((static_cast<uint64_t>(width) + 127) / 128) * 2;
+}
+
+uint64_t PSDLayout::max_merged_data_length(int channels, int width,
+    int height)
+{
+    return static_cast<uint64_t>(channels) * height
+        * PSDCompressedImage::max_packed_length(width);
+}
+
+uint16_t PSDLayout::version() const
+{
+    return format == PSDFormat::PSB ? 2 : 1;
+}
+
+size_t PSDLayout::length_size() const
+{
+    return format == PSDFormat::PSB ? sizeof(uint64_t) : sizeof(uint32_t);
+}
+
+size_t PSDLayout::bytecount_size() const
+{
+    return format == PSDFormat::PSB ? sizeof(uint32_t) : sizeof(uint16_t);
+}
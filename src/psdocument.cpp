@@ -7,6 +7,8 @@
 #include "psdtypes.hpp"
 #include "psdimage.hpp"
 #include "psdwriter.hpp"
+#include "psdlayout.hpp"
+#include "psdzip.hpp"
 
 #include <cstdint>
 #include <string>
@@ -15,6 +17,7 @@
 #include <algorithm>
 #include <filesystem>
 #include <memory>
+#include <future>
 
 using namespace psdw;
 using namespace psdimpl;
@@ -28,24 +31,23 @@ public:
         int doc_height,
         const PSDColour doc_background_rgb)
     {
-        // Check inputs are within the PSD maximum values. Clip if not.
+        // Check inputs are within the PSB maximum values. Clip if not.
+        const int max_dimension{ PSDLayout::max_psb_dimension };
         m_data.header.width = doc_width < 1 ? 1 :
-            doc_width > 30000 ? 30000 :
+            doc_width > max_dimension ? max_dimension :
             static_cast<uint32_t>(doc_width);
         m_data.header.height = doc_height < 1 ? 1 :
-            doc_height > 30000 ? 30000 :
+            doc_height > max_dimension ? max_dimension :
             static_cast<uint32_t>(doc_height);
 
         // Generate background, add to channel data and merged image data.
         m_data.image_data.generate(
             m_data.header.width, m_data.header.height, doc_background_rgb);
+        auto background{ std::make_unique<PSDCompressedImage>() };
+        background->generate(
+            m_data.header.width, m_data.header.height, doc_background_rgb);
         m_data.layer_and_mask_info.layer_image_data.push_back(
-            std::make_unique<PSDCompressedImage>(PSDCompressedImage{}));
-        m_data.layer_and_mask_info.layer_image_data.back()->load(
-            m_data.image_data.data(),
-            m_data.image_data.channels(),
-            m_data.image_data.width(),
-            m_data.image_data.height());
+            std::move(background));
 
         // Update layer and mask section data.
         m_data.layer_and_mask_info.layer_records.push_back(
@@ -53,35 +55,12 @@ public:
         m_data.layer_and_mask_info.layer_records.back().layer_content_rect = {
             0, 0, m_data.header.height, m_data.header.width };
         m_data.layer_and_mask_info.layer_records.back().channel_count = 3;
-
-        m_data.layer_and_mask_info.layer_records.back().red_channel_info.length =
-            static_cast<uint32_t>(
-                sizeof(m_data.layer_and_mask_info.layer_image_data.
-                    back()->data()[0].compression)
-                + m_data.layer_and_mask_info.layer_image_data.
-                back()->data()[0].bytecounts.size() * sizeof(uint16_t)
-                + m_data.layer_and_mask_info.layer_image_data.
-                back()->data()[0].image_data.size());
-        m_data.layer_and_mask_info.layer_records.back().green_channel_info.length =
-            static_cast<uint32_t>(
-                sizeof(m_data.layer_and_mask_info.layer_image_data.
-                    back()->data()[1].compression)
-                + m_data.layer_and_mask_info.layer_image_data.
-                back()->data()[1].bytecounts.size() * sizeof(uint16_t)
-                + m_data.layer_and_mask_info.layer_image_data.
-                back()->data()[1].image_data.size());
-        m_data.layer_and_mask_info.layer_records.back().blue_channel_info.length =
-            static_cast<uint32_t>(
-                sizeof(m_data.layer_and_mask_info.layer_image_data.
-                    back()->data()[2].compression)
-                + m_data.layer_and_mask_info.layer_image_data.
-                back()->data()[2].bytecounts.size() * sizeof(uint16_t)
-                + m_data.layer_and_mask_info.layer_image_data.
-                back()->data()[2].image_data.size());
     }
 
     PSDStatus set_resolution(double ppi)
     {
+        if (released())
+            return m_status;
         m_status = PSDStatus::Success;
         if (ppi < 1 || ppi >= 30000)
         {
@@ -103,6 +82,8 @@ public:
 
     PSDStatus set_profile(std::filesystem::path icc_profile)
     {
+        if (released())
+            return m_status;
         m_status = PSDStatus::Success;
 
         std::ifstream profilef{ icc_profile, std::ios::binary | std::ios::ate };
@@ -126,8 +107,48 @@ public:
         return m_status;
     }
 
+    PSDStatus set_format(PSDFormat format)
+    {
+        if (released())
+            return m_status;
+        m_status = PSDStatus::Success;
+
+        m_data.format = format;
+
+        return m_status;
+    }
+
+    PSDStatus set_zip_level(int level)
+    {
+        if (released())
+            return m_status;
+        m_status = PSDStatus::Success;
+        if (level < 0 || level > PSDZip::max_level)
+        {
+            m_status = PSDStatus::InvalidArgument;
+            return m_status;
+        }
+
+        m_zip_level = level;
+
+        return m_status;
+    }
+
+    PSDStatus set_maximize_compatibility(bool maximize)
+    {
+        if (released())
+            return m_status;
+        m_status = PSDStatus::Success;
+
+        m_data.image_resources.version_info.has_real_merged_data = maximize;
+
+        return m_status;
+    }
+
     PSDStatus add_guide(int position, PSDOrientation orientation)
     {
+        if (released())
+            return m_status;
         m_status = PSDStatus::Success;
 
         int multiplier = 32;
@@ -147,6 +168,8 @@ public:
         PSDChannelOrder channel_order,
         PSDCompression compression)
     {
+        if (released())
+            return m_status;
         m_status = PSDStatus::Success;
         if (rect.w <= 0 || rect.h <= 0 || layer_name.length() > 251)
         {
@@ -159,8 +182,19 @@ public:
             m_data.layer_and_mask_info.layer_image_data.push_back(
                 std::make_unique<PSDRawImage>(PSDRawImage{}));
         else
+        {
+            /* A PSB stores 4 byte bytecounts, which Auto weighs against RLE. 
+            An Auto document that only becomes a PSB by outgrowing 2 GiB is 
+            not known to be one yet, so is judged as a PSD. */
+            bool psb{ m_data.format == PSDFormat::PSB
+                || (m_data.format == PSDFormat::Auto
+                    && (!PSDLayout::fits_psd_dimensions(m_data)
+                        || static_cast<uint32_t>(rect.w) > PSDLayout::max_psd_dimension
+                        || static_cast<uint32_t>(rect.h) > PSDLayout::max_psd_dimension)) };
             m_data.layer_and_mask_info.layer_image_data.push_back(
-                std::make_unique<PSDCompressedImage>(PSDCompressedImage{}));
+                std::make_unique<PSDCompressedImage>(compression, m_zip_level,
+                    psb ? sizeof(uint32_t) : sizeof(uint16_t)));
+        }
 
         psdimpl::ChannelOrder co;
         if (channel_order == psdw::PSDChannelOrder::RGBA)
@@ -170,11 +204,18 @@ public:
 
         m_data.layer_and_mask_info.layer_image_data.back()->load(
             img, co, rect.w, rect.h);
+        if (compression == PSDCompression::RLEOptimal)
+        {
+            m_rle_savings += static_cast<const PSDCompressedImage&>(
+                *m_data.layer_and_mask_info.layer_image_data.back()).savings();
+        }
 
-        // Add image to merged image.
+        // Composite into the merged image when it is next needed.
         if (visible)
         {
-            m_data.image_data.composite(img, rect, channel_order);
+            m_pending.push_back(PSDPendingLayer{
+                m_data.layer_and_mask_info.layer_image_data.back().get(),
+                rect });
         }
 
         // Update layer data.
@@ -187,59 +228,110 @@ public:
         m_data.layer_and_mask_info.layer_records.back().layer_content_rect = {
             static_cast<uint32_t>(rect.y),
             static_cast<uint32_t>(rect.x),
-            static_cast<uint32_t>(rect.h + rect.y),
-            static_cast<uint32_t>(rect.w + rect.x) };
+            static_cast<uint32_t>(rect.h) + static_cast<uint32_t>(rect.y),
+            static_cast<uint32_t>(rect.w) + static_cast<uint32_t>(rect.x) };
         m_data.layer_and_mask_info.layer_records.back().channel_count = 4;
         m_data.layer_and_mask_info.layer_records.back().reference_point.x = rect.x;
         m_data.layer_and_mask_info.layer_records.back().reference_point.y = rect.y;
-        
-        m_data.layer_and_mask_info.layer_records.back().alpha_channel_info.length =
-            static_cast<uint32_t>(
-                sizeof(m_data.layer_and_mask_info.layer_image_data.
-                    back()->data()[0].compression)
-                + m_data.layer_and_mask_info.layer_image_data.
-                back()->data()[0].bytecounts.size() * sizeof(uint16_t)
-                + m_data.layer_and_mask_info.layer_image_data.
-                back()->data()[0].image_data.size());
-        m_data.layer_and_mask_info.layer_records.back().red_channel_info.length =
-            static_cast<uint32_t>(
-                sizeof(m_data.layer_and_mask_info.layer_image_data.
-                    back()->data()[1].compression)
-                + m_data.layer_and_mask_info.layer_image_data.
-                back()->data()[1].bytecounts.size() * sizeof(uint16_t)
-                + m_data.layer_and_mask_info.layer_image_data.
-                back()->data()[1].image_data.size());
-        m_data.layer_and_mask_info.layer_records.back().green_channel_info.length =
-            static_cast<uint32_t>(
-                sizeof(m_data.layer_and_mask_info.layer_image_data.
-                    back()->data()[2].compression)
-                + m_data.layer_and_mask_info.layer_image_data.
-                back()->data()[2].bytecounts.size() * sizeof(uint16_t)
-                + m_data.layer_and_mask_info.layer_image_data.
-                back()->data()[2].image_data.size());
-        m_data.layer_and_mask_info.layer_records.back().blue_channel_info.length =
-            static_cast<uint32_t>(
-                sizeof(m_data.layer_and_mask_info.layer_image_data.
-                    back()->data()[3].compression)
-                + m_data.layer_and_mask_info.layer_image_data.
-                back()->data()[3].bytecounts.size() * sizeof(uint16_t)
-                + m_data.layer_and_mask_info.layer_image_data.
-                back()->data()[3].image_data.size());
+
+        return m_status;
+    }
+
+    PSDStatus flatten()
+    {
+        if (released())
+            return m_status;
+        m_status = PSDStatus::Success;
+
+        // Without a merged image, layers are left for the reader to composite.
+        if (!m_data.image_resources.version_info.has_real_merged_data)
+            return m_status;
+        m_data.image_data.composite(m_pending);
+        m_pending.clear();
 
         return m_status;
     }
 
     PSDStatus save(const std::filesystem::path& filepath,
-        bool overwrite)
+        bool overwrite,
+        PSDSaveMode mode)
+    {
+        if (flatten() != PSDStatus::Success)
+            return m_status;
+        m_status = m_writer.write(filepath, overwrite, mode);
+        return m_status;
+    }
+
+    PSDStatus save_to_memory(std::vector<uint8_t>& buffer)
+    {
+        if (flatten() != PSDStatus::Success)
+            return m_status;
+        m_status = m_writer.write(buffer);
+        return m_status;
+    }
+
+    PSDStatus save(const PSDSink& sink)
     {
-        m_status = m_writer.write(filepath, overwrite);
+        if (flatten() != PSDStatus::Success)
+            return m_status;
+        m_status = m_writer.write(sink);
         return m_status;
     }
 
+    std::future<PSDStatus> save_async(const std::filesystem::path& filepath,
+        bool overwrite,
+        PSDSaveMode mode)
+    {
+        if (released())
+        {
+            std::promise<PSDStatus> result;
+            result.set_value(m_status);
+            return result.get_future();
+        }
+
+        /* The data is moved into the job, leaving nothing to be copied. The
+        layers are owned by the data, so are still there to composite. */
+        m_status = PSDStatus::Success;
+        m_released = true;
+        auto data{ std::make_unique<PSDData>(std::move(m_data)) };
+
+        return std::async(std::launch::async,
+            [data = std::move(data), pending = std::move(m_pending), filepath,
+                overwrite, mode]()
+            {
+                if (data->image_resources.version_info.has_real_merged_data)
+                    data->image_data.composite(pending);
+                PSDWriter writer{ *data };
+                return writer.write(filepath, overwrite, mode);
+            });
+    }
+
+    uint64_t estimated_size() const
+    {
+        return m_released ? 0 : m_writer.plan_largest().file_size;
+    }
+
+    uint64_t rle_savings() const { return m_released ? 0 : m_rle_savings; }
+
     PSDStatus status() const { return m_status; }
 
+    const PSDData* data() const { return m_released ? nullptr : &m_data; }
+
 private:
+    // After save_async, the document's data belongs to the background save.
+    bool released()
+    {
+        if (m_released)
+            m_status = PSDStatus::InvalidArgument;
+        return m_released;
+    }
+
     PSDStatus m_status{ PSDStatus::Success };
+    bool m_released{ false };
+    int m_zip_level{ PSDZip::default_level };
+    uint64_t m_rle_savings{};
+    // Visible layers added since the merged image was last composited.
+    std::vector<PSDPendingLayer> m_pending{};
 	psdimpl::PSDData m_data{};
 	psdimpl::PSDWriter m_writer{ m_data };
 };
@@ -269,6 +361,21 @@ PSDStatus PSDocument::set_profile(std::filesystem::path icc_profile)
     return m_psdocument->set_profile(icc_profile);
 }
 
+PSDStatus PSDocument::set_format(PSDFormat format)
+{
+    return m_psdocument->set_format(format);
+}
+
+PSDStatus PSDocument::set_zip_level(int level)
+{
+    return m_psdocument->set_zip_level(level);
+}
+
+PSDStatus PSDocument::set_maximize_compatibility(bool maximize)
+{
+    return m_psdocument->set_maximize_compatibility(maximize);
+}
+
 PSDStatus PSDocument::add_guide(int position, PSDOrientation orientation)
 {
     return m_psdocument->add_guide(position, orientation);
@@ -285,12 +392,61 @@ PSDStatus PSDocument::add_layer(const unsigned char* img,
 }
 
 PSDStatus PSDocument::save(const std::filesystem::path& filename,
-    bool overwrite)
+    bool overwrite,
+    PSDSaveMode mode)
+{
+    return m_psdocument->save(filename, overwrite, mode);
+}
+
+PSDStatus PSDocument::save_to_memory(std::vector<uint8_t>& buffer)
+{
+    return m_psdocument->save_to_memory(buffer);
+}
+
+std::future<PSDStatus> PSDocument::save_async(
+    const std::filesystem::path& filename,
+    bool overwrite,
+    PSDSaveMode mode)
+{
+    return m_psdocument->save_async(filename, overwrite, mode);
+}
+
+PSDStatus PSDocument::save(const PSDSink& sink)
 {
-    return m_psdocument->save(filename, overwrite);
+    return m_psdocument->save(sink);
+}
+
+PSDStatus PSDocument::save(std::ostream& stream)
+{
+    return m_psdocument->save(
+        [&stream](const unsigned char* data, size_t size)
+        {
+            stream.write(reinterpret_cast<const char*>(data), size);
+            return static_cast<bool>(stream);
+        });
+}
+
+PSDStatus PSDocument::flatten()
+{
+    return m_psdocument->flatten();
+}
+
+uint64_t PSDocument::estimated_size() const
+{
+    return m_psdocument->estimated_size();
+}
+
+uint64_t PSDocument::rle_savings() const
+{
+    return m_psdocument->rle_savings();
 }
 
 PSDStatus PSDocument::status() const
 {
     return m_psdocument->status();
 }
+
+const PSDData* PSDocument::data() const
+{
+    return m_psdocument->data();
+}
@@ -0,0 +1,329 @@
+// Copyright (c) 2024 Dan Kemp. All rights reserved.
+// This source code is licensed under the MIT license found in the 
+// LICENSE file in the root directory of this source tree.
+
+#include "psdoutput.hpp"
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include <filesystem>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+using namespace psdimpl;
+
+#ifdef _WIN32
+
+PSDFileOutput::PSDFileOutput(const std::filesystem::path& filepath,
+    uint64_t size)
+{
+    // Overlapped, so that positional writes from several threads can be in
+    // flight at once.
+    HANDLE handle{ CreateFileW(filepath.c_str(),
+        GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, nullptr) };
+    if (handle == INVALID_HANDLE_VALUE)
+        return;
+    m_handle = handle;
+
+    LARGE_INTEGER end{};
+    end.QuadPart = static_cast<LONGLONG>(size);
+    if (!SetFilePointerEx(handle, end, nullptr, FILE_BEGIN)
+        || !SetEndOfFile(handle))
+    {
+        close();
+    }
+}
+
+bool PSDFileOutput::write(uint64_t offset, const char* data, size_t size)
+{
+    while (size > 0)
+    {
+        DWORD chunk{ static_cast<DWORD>(
+            std::min(size, static_cast<size_t>(1) << 30)) };
+
+        OVERLAPPED overlapped{};
+        overlapped.Offset = static_cast<DWORD>(offset & 0xffffffff);
+        overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+        overlapped.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        if (!overlapped.hEvent)
+            return false;
+
+        DWORD written{};
+        BOOL ok{ WriteFile(m_handle, data, chunk, nullptr, &overlapped) };
+        if (ok || GetLastError() == ERROR_IO_PENDING)
+            ok = GetOverlappedResult(m_handle, &overlapped, &written, TRUE);
+        CloseHandle(overlapped.hEvent);
+        if (!ok || written == 0)
+            return false;
+
+        offset += written;
+        data += written;
+        size -= written;
+    }
+
+    return true;
+}
+
+bool PSDFileOutput::is_open() const
+{
+    return m_handle != nullptr;
+}
+
+bool PSDFileOutput::close()
+{
+    if (!m_handle)
+        return false;
+    BOOL ok{ CloseHandle(m_handle) };
+    m_handle = nullptr;
+
+    return ok;
+}
+
+#else
+
+PSDFileOutput::PSDFileOutput(const std::filesystem::path& filepath,
+    uint64_t size)
+{
+    int fd{ ::open(filepath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+        0666) };
+    if (fd < 0)
+        return;
+    m_fd = fd;
+
+    if (::ftruncate(m_fd, static_cast<off_t>(size)) != 0)
+        close();
+}
+
+bool PSDFileOutput::write(uint64_t offset, const char* data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t written{ ::pwrite(m_fd, data, size,
+            static_cast<off_t>(offset)) };
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+
+        offset += written;
+        data += written;
+        size -= written;
+    }
+
+    return true;
+}
+
+bool PSDFileOutput::is_open() const
+{
+    return m_fd >= 0;
+}
+
+bool PSDFileOutput::close()
+{
+    if (m_fd < 0)
+        return false;
+    int result{ ::close(m_fd) };
+    m_fd = -1;
+
+    return result == 0;
+}
+
+#endif
+
+PSDFileOutput::~PSDFileOutput()
+{
+    if (is_open())
+        close();
+}
+
+PSDMemoryOutput::PSDMemoryOutput(uint8_t* data, size_t size, uint64_t offset)
+    : m_data{ data }, m_size{ size }, m_offset{ offset }
+{
+}
+
+bool PSDMemoryOutput::write(uint64_t offset, const char* data, size_t size)
+{
+    if (offset < m_offset || offset - m_offset + size > m_size)
+        return false;
+    std::memcpy(m_data + (offset - m_offset), data, size);
+
+    return true;
+}
+
+PSDSinkOutput::PSDSinkOutput(const psdw::PSDSink& sink)
+    : m_sink{ sink }
+{
+}
+
+bool PSDSinkOutput::write(uint64_t offset, const char* data, size_t size)
+{
+    if (offset != m_position
+        || !m_sink(reinterpret_cast<const unsigned char*>(data), size))
+    {
+        return false;
+    }
+    m_position += size;
+
+    return true;
+}
+
+#ifdef _WIN32
+
+PSDMappedOutput::PSDMappedOutput(const std::filesystem::path& filepath,
+    uint64_t size)
+    : PSDFileOutput{ filepath, size }, m_size{ size }
+{
+    if (!is_open())
+        return;
+
+    /* Reserve the clusters before mapping. A write through a view to a 
+    full disk raises an exception rather than failing. */
+    FILE_ALLOCATION_INFO allocation{};
+    allocation.AllocationSize.QuadPart = static_cast<LONGLONG>(size);
+    if (!SetFileInformationByHandle(m_handle, FileAllocationInfo,
+        &allocation, sizeof(allocation)))
+    {
+        PSDFileOutput::close();
+        return;
+    }
+
+    HANDLE mapping{ CreateFileMappingW(m_handle, nullptr, PAGE_READWRITE,
+        static_cast<DWORD>(size >> 32),
+        static_cast<DWORD>(size & 0xffffffff), nullptr) };
+    if (!mapping)
+    {
+        PSDFileOutput::close();
+        return;
+    }
+    m_mapping = mapping;
+}
+
+char* PSDMappedOutput::map(uint64_t offset, size_t size)
+{
+    if (!unmap() || !m_mapping || offset + size > m_size)
+        return nullptr;
+
+    SYSTEM_INFO info{};
+    GetSystemInfo(&info);
+    const uint64_t start{ offset - offset % info.dwAllocationGranularity };
+    const size_t view_size{ static_cast<size_t>(offset - start) + size };
+    void* view{ MapViewOfFile(m_mapping, FILE_MAP_WRITE,
+        static_cast<DWORD>(start >> 32),
+        static_cast<DWORD>(start & 0xffffffff), view_size) };
+    if (!view)
+        return nullptr;
+    m_view = static_cast<char*>(view);
+    m_view_size = view_size;
+
+    return m_view + (offset - start);
+}
+
+bool PSDMappedOutput::unmap()
+{
+    if (!m_view)
+        return true;
+    BOOL ok{ UnmapViewOfFile(m_view) };
+    m_view = nullptr;
+    m_view_size = 0;
+
+    return ok;
+}
+
+bool PSDMappedOutput::close(uint64_t final_size)
+{
+    bool ok{ unmap() };
+    if (m_mapping)
+        ok = CloseHandle(m_mapping) && ok;
+    m_mapping = nullptr;
+    if (!is_open())
+        return false;
+
+    LARGE_INTEGER end{};
+    end.QuadPart = static_cast<LONGLONG>(final_size);
+    ok = SetFilePointerEx(m_handle, end, nullptr, FILE_BEGIN)
+        && SetEndOfFile(m_handle) && ok;
+
+    return PSDFileOutput::close() && ok;
+}
+
+#else
+
+PSDMappedOutput::PSDMappedOutput(const std::filesystem::path& filepath,
+    uint64_t size)
+    : PSDFileOutput{ filepath, size }, m_size{ size }
+{
+    if (!is_open() || !size)
+        return;
+
+    /* Allocate the blocks before mapping, rather than leaving a sparse 
+    file. A write through the mapping to a full disk raises SIGBUS rather 
+    than failing. */
+#ifdef __APPLE__
+    fstore_t store{ F_ALLOCATEALL, F_PEOFPOSMODE, 0,
+        static_cast<off_t>(size), 0 };
+    if (::fcntl(m_fd, F_PREALLOCATE, &store) == -1)
+        PSDFileOutput::close();
+#else
+    if (::posix_fallocate(m_fd, 0, static_cast<off_t>(size)) != 0)
+        PSDFileOutput::close();
+#endif
+}
+
+char* PSDMappedOutput::map(uint64_t offset, size_t size)
+{
+    if (!unmap() || !is_open() || offset + size > m_size)
+        return nullptr;
+
+    const uint64_t page{ static_cast<uint64_t>(::sysconf(_SC_PAGESIZE)) };
+    const uint64_t start{ offset - offset % page };
+    const size_t view_size{ static_cast<size_t>(offset - start) + size };
+    void* view{ ::mmap(nullptr, view_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED, m_fd, static_cast<off_t>(start)) };
+    if (view == MAP_FAILED)
+        return nullptr;
+    m_view = static_cast<char*>(view);
+    m_view_size = view_size;
+
+    return m_view + (offset - start);
+}
+
+bool PSDMappedOutput::unmap()
+{
+    if (!m_view)
+        return true;
+    int result{ ::munmap(m_view, m_view_size) };
+    m_view = nullptr;
+    m_view_size = 0;
+
+    return result == 0;
+}
+
+bool PSDMappedOutput::close(uint64_t final_size)
+{
+    bool ok{ unmap() };
+    if (!is_open())
+        return false;
+    ok = ::ftruncate(m_fd, static_cast<off_t>(final_size)) == 0 && ok;
+
+    return PSDFileOutput::close() && ok;
+}
+
+#endif
+
+PSDMappedOutput::~PSDMappedOutput()
+{
+    if (is_open())
+        close(m_size);
+}
@@ -0,0 +1,78 @@
+// Copyright (c) 2024 Dan Kemp. All rights reserved.
+// This source code is licensed under the MIT license found in the 
+// LICENSE file in the root directory of this source tree.
+
+#include "psdparallel.hpp"
+
+#include <cstddef>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace psdimpl;
+
+PSDThreadPool& PSDThreadPool::instance()
+{
+    // Deliberately never destroyed.
+    static PSDThreadPool* pool{ new PSDThreadPool{} };
+    return *pool;
+}
+
+PSDThreadPool::PSDThreadPool()
+{
+    const unsigned cores{ std::max(1u, std::thread::hardware_concurrency()) };
+    m_workers = cores - 1;
+    for (size_t t{}; t < m_workers; ++t)
+        std::thread{ [this]() { work(); } }.detach();
+}
+
+void PSDThreadPool::run(size_t count, Call call, void* context)
+{
+    Job job{ count, call, context };
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        m_jobs.push_back(&job);
+    }
+    if (count - 1 >= m_workers)
+    {
+        m_work.notify_all();
+    }
+    else
+    {
+        for (size_t i{ 1 }; i < count; ++i)
+            m_work.notify_one();
+    }
+
+    job.run();
+
+    // Every task has been taken, so wait for the workers still running one.
+    std::unique_lock<std::mutex> lock{ m_mutex };
+    std::erase(m_jobs, &job);
+    m_idle.wait(lock, [&]() { return job.active == 0; });
+}
+
+void PSDThreadPool::work()
+{
+    std::unique_lock<std::mutex> lock{ m_mutex };
+    for (;;)
+    {
+        m_work.wait(lock, [this]() { return !m_jobs.empty(); });
+        Job* job{ m_jobs.front() };
+        ++job->active;
+        lock.unlock();
+
+        job->run();
+
+        lock.lock();
+        std::erase(m_jobs, job);
+        if (--job->active == 0)
+            m_idle.notify_all();
+    }
+}
+
+void PSDThreadPool::Job::run()
+{
+    for (size_t i{ next++ }; i < count; i = next++)
+        call(context, i);
+}
@@ -4,11 +4,17 @@
 
 #include "psdwriter.hpp"
 #include "psddata.hpp"
+#include "psdlayout.hpp"
+#include "psdoutput.hpp"
+#include "psdparallel.hpp"
 #include "psdtypes.hpp"
 
 #include <filesystem>
 #include <bit>
 #include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
 #include <string>
 #include <vector>
 
@@ -20,7 +26,8 @@ PSDWriter::PSDWriter(const PSDData& psd_data)
 {
 }
 
-PSDStatus PSDWriter::write(const std::filesystem::path& filepath, bool overwrite)
+PSDStatus PSDWriter::write(const std::filesystem::path& filepath,
+    bool overwrite, PSDSaveMode mode)
 {
     m_status = PSDStatus::Success;
 
@@ -30,16 +37,345 @@ PSDStatus PSDWriter::write(const std::filesystem::path& filepath, bool overwrite
         return m_status;
     }
 
-    m_writer.open(filepath, std::ios::binary | std::ios::trunc);
-    if (!m_writer)
+    /* In MemoryMapped mode, the merged image is compressed straight into the
+    file, so the file is mapped at its largest possible size. */
+    std::vector<uint32_t> merged_bytecounts{};
+    const PSDLayout layout{ mode == PSDSaveMode::MemoryMapped
+        ? plan_mapped()
+        : plan_measured(merged_bytecounts, true) };
+
+    // Check the document fits its format before touching the disk.
+    if (!layout.within_limits)
     {
         m_status = PSDStatus::FileWriteError;
         return m_status;
     }
-    
+
+    bool success{ mode == PSDSaveMode::MemoryMapped
+        ? write_mapped(filepath, layout)
+        : write_positional(filepath, layout, merged_bytecounts) };
+    if (!success)
+    {
+        m_status = PSDStatus::FileWriteError;
+        std::filesystem::remove(filepath);
+    }
+
+    return m_status;
+}
+
+PSDStatus PSDWriter::write(std::vector<uint8_t>& buffer)
+{
+    m_status = PSDStatus::Success;
+
+    std::vector<uint32_t> merged_bytecounts{};
+    const PSDLayout layout{ plan_measured(merged_bytecounts, true) };
+
+    // Check the document fits its format.
+    if (!layout.within_limits)
+    {
+        m_status = PSDStatus::FileWriteError;
+        return m_status;
+    }
+
+    buffer.resize(static_cast<size_t>(layout.file_size));
+    PSDMemoryOutput output{ buffer.data(), buffer.size() };
+    begin(output);
+    write_layers(layout);
+    write_image_data(merged_bytecounts, layout);
+    if (!end() || m_offset != layout.file_size)
+    {
+        m_status = PSDStatus::FileWriteError;
+        buffer.clear();
+    }
+
+    return m_status;
+}
+
+PSDStatus PSDWriter::write(const PSDSink& sink)
+{
+    m_status = PSDStatus::Success;
+
+    std::vector<uint32_t> merged_bytecounts{};
+    const PSDLayout layout{ plan_measured(merged_bytecounts, true) };
+
+    // Check the document fits its format before anything is sent.
+    if (!layout.within_limits)
+    {
+        m_status = PSDStatus::FileWriteError;
+        return m_status;
+    }
+
+    PSDSinkOutput output{ sink };
+    begin(output);
+    write_layers(layout);
+    write_image_data(merged_bytecounts, layout);
+    if (!end() || m_offset != layout.file_size)
+        m_status = PSDStatus::FileWriteError;
+
+    return m_status;
+}
+
+PSDStatus PSDWriter::write_records(const PSDLayout& layout,
+    std::vector<uint8_t>& buffer)
+{
+    m_status = PSDStatus::Success;
+
+    buffer.resize(static_cast<size_t>(layout.channel_data_offset));
+    PSDMemoryOutput output{ buffer.data(), buffer.size() };
+    begin(output);
+    write_records(layout);
+    if (!end() || m_offset != layout.channel_data_offset)
+        m_status = PSDStatus::FileWriteError;
+
+    return m_status;
+}
+
+PSDStatus PSDWriter::write_global_layer_info(const PSDLayout& layout,
+    std::vector<uint8_t>& buffer)
+{
+    m_status = PSDStatus::Success;
+
+    uint64_t offset{ layout.channel_data_offset + layout.channel_data_length };
+    buffer.resize(static_cast<size_t>(layout.image_data_offset - offset));
+    PSDMemoryOutput output{ buffer.data(), buffer.size(), offset };
+    begin(output, offset);
+    write_global_layer_info(layout);
+    if (!end() || m_offset != layout.image_data_offset)
+        m_status = PSDStatus::FileWriteError;
+
+    return m_status;
+}
+
+const PSDRawImage& PSDWriter::merged_source()
+{
+    if (m_data.image_resources.version_info.has_real_merged_data)
+        return m_data.image_data;
+
+    // Without it, Photoshop leaves a white image in its place.
+    m_placeholder.generate(m_data.image_data.width(),
+        m_data.image_data.height(), { 255, 255, 255 });
+    return m_placeholder;
+}
+
+PSDLayout PSDWriter::plan_mapped()
+{
+    const PSDRawImage& raw_image{ merged_source() };
+    const PSDLayout smallest{ m_data, PSDLayout::min_merged_data_length(
+        raw_image.channels(), raw_image.width(), raw_image.height()) };
+    if (!smallest.within_limits)
+        return smallest;
+    PSDLayout largest{ plan_largest() };
+    if (largest.within_limits && largest.format == smallest.format)
+        return largest;
+
+    /* Whether the document is a PSD or a PSB depends on the real size of 
+    the merged image, as it does when saved any other way, so it is 
+    measured. Only the mapping is sized for the worst case. */
+    std::vector<uint32_t> bytecounts{};
+    const PSDLayout real{ plan_measured(bytecounts) };
+    if (!real.within_limits)
+        return real;
+    return { m_data, PSDLayout::max_merged_data_length(raw_image.channels(),
+        raw_image.width(), raw_image.height()), real.format };
+}
+
+PSDLayout PSDWriter::plan_measured(std::vector<uint32_t>& bytecounts,
+    bool keep_packed)
+{
+    const PSDRawImage& raw_image{ merged_source() };
+    PSDLayout smallest{ m_data, PSDLayout::min_merged_data_length(
+        raw_image.channels(), raw_image.width(), raw_image.height()) };
+    if (!smallest.within_limits)
+        return smallest;
+
+    /* Bands of rows are measured concurrently. Those that fit in what is 
+    left of the budget are kept packed, to be written without packing them 
+    again. */
+    const int width{ raw_image.width() };
+    const int height{ raw_image.height() };
+    const size_t rows{ static_cast<size_t>(raw_image.channels()) * height };
+    const size_t band_rows{ std::max<size_t>(1,
+        band_size / std::max(1, width)) };
+    const size_t bands{ (rows + band_rows - 1) / band_rows };
+    bytecounts.resize(rows);
+    m_packed_bands.clear();
+    m_packed_bands.resize(keep_packed ? bands : 0);
+    std::atomic<size_t> budget{ keep_packed ? packed_budget : 0 };
+    parallel_for(bands, [&](size_t band)
+        {
+            const size_t begin{ band * band_rows };
+            const size_t end{ std::min(rows, begin + band_rows) };
+            std::vector<uint8_t> row(static_cast<size_t>(width));
+            std::vector<uint8_t> packed((end - begin)
+                * PSDCompressedImage::max_packed_length(width));
+            PackedRow last{};
+            size_t length{};
+            for (size_t r{ begin }; r < end; r++)
+            {
+                bytecounts[r] = static_cast<uint32_t>(pack_merged_row(
+                    raw_image, static_cast<int>(r / height),
+                    static_cast<int>(r % height), row.data(),
+                    packed.data() + length, last));
+                length += bytecounts[r];
+            }
+
+            size_t left{ budget.load() };
+            while (left >= length
+                && !budget.compare_exchange_weak(left, left - length))
+            {
+            }
+            if (keep_packed && left >= length)
+                m_packed_bands[band].assign(packed.begin(),
+                    packed.begin() + static_cast<ptrdiff_t>(length));
+        });
+    uint64_t merged_data_length{};
+    for (uint32_t bytecount : bytecounts)
+        merged_data_length += bytecount;
+
+    return { m_data, merged_data_length };
+}
+
+PSDLayout PSDWriter::plan_largest() const
+{
+    const PSDRawImage& merged_image{ m_data.image_data };
+    return { m_data, PSDLayout::max_merged_data_length(
+        merged_image.channels(), merged_image.width(),
+        merged_image.height()) };
+}
+
+size_t PSDWriter::pack_merged_row(const PSDRawImage& image, int channel,
+    int y, uint8_t* buffer, uint8_t* out, PackedRow& last)
+{
+    const uint8_t* row{ image.row(channel, y, buffer) };
+    if (row != buffer && row == last.source)
+    {
+        std::memcpy(out, last.data.data(), last.data.size());
+        return last.data.size();
+    }
+
+    const size_t length{ PSDCompressedImage::pack_row(row, image.width(),
+        out) };
+    // Rows gathered into buffer change under the same address.
+    if (row != buffer)
+    {
+        last.source = row;
+        last.data.assign(out, out + length);
+    }
+    return length;
+}
+
+bool PSDWriter::write_positional(const std::filesystem::path& filepath,
+    const PSDLayout& layout, const std::vector<uint32_t>& merged_bytecounts)
+{
+    PSDFileOutput output{ filepath, layout.file_size };
+    if (!output.is_open())
+        return false;
+
+    begin(output);
+    write_layers(layout);
+    write_image_data(merged_bytecounts, layout);
+    bool success{ end() && m_offset == layout.file_size };
+
+    return output.close() && success;
+}
+
+bool PSDWriter::write_mapped(const std::filesystem::path& filepath,
+    const PSDLayout& layout)
+{
+    /* The file is allocated at its largest possible size, so that the 
+    merged image can be compressed directly into it. It is truncated to the 
+    real size afterwards. Everything else is written to the file, and only 
+    a window of the merged image is mapped at a time. */
+    const PSDRawImage& merged_image{ merged_source() };
+
+    PSDMappedOutput output{ filepath, layout.file_size };
+    if (!output.is_open())
+        return false;
+
+    begin(output);
+    write_layers(layout);
+    bool success{ end() && m_offset == layout.image_data_offset };
+
+    const size_t rows{ static_cast<size_t>(merged_image.channels())
+        * merged_image.height() };
+    const size_t max_length{ PSDCompressedImage::max_packed_length(
+        merged_image.width()) };
+    std::vector<uint32_t> bytecounts(rows);
+    std::vector<uint8_t> row(static_cast<size_t>(merged_image.width()));
+    PackedRow last{};
+    uint64_t offset{ layout.image_data_offset + sizeof(uint16_t)
+        + rows * layout.bytecount_size() };
+    char* window{ nullptr };
+    uint64_t window_offset{};
+    uint64_t window_end{};
+    for (size_t r{}; success && r < rows; r++)
+    {
+        // Move the window on when the next row might not fit in it.
+        if (offset + max_length > window_end)
+        {
+            const size_t size{ static_cast<size_t>(std::min<uint64_t>(
+                std::max(window_size, max_length),
+                layout.file_size - offset)) };
+            window = output.map(offset, size);
+            window_offset = offset;
+            window_end = offset + size;
+            success = window != nullptr;
+            if (!success)
+                break;
+        }
+
+        const size_t row_length{ pack_merged_row(merged_image,
+            static_cast<int>(r / merged_image.height()),
+            static_cast<int>(r % merged_image.height()), row.data(),
+            reinterpret_cast<uint8_t*>(window) + (offset - window_offset),
+            last) };
+        bytecounts[r] = static_cast<uint32_t>(row_length);
+        offset += row_length;
+    }
+
+    if (success)
+    {
+        const uint16_t compression{ 1 };
+        begin(output, layout.image_data_offset);
+        write(compression);
+        write_bytecounts(bytecounts, layout.bytecount_size());
+        success = end();
+    }
+
+    return output.close(success ? offset : 0) && success;
+}
+
+void PSDWriter::begin(PSDOutput& output, uint64_t offset)
+{
+    m_output = &output;
+    m_offset = offset;
+    m_failed = false;
+    m_buffer.resize(buffer_size);
+    m_buffer_pos = 0;
+}
+
+bool PSDWriter::end()
+{
+    flush();
+    m_buffer.clear();
+    m_buffer.shrink_to_fit();
+    m_output = nullptr;
+
+    return !m_failed;
+}
+
+void PSDWriter::write_layers(const PSDLayout& layout)
+{
+    write_records(layout);
+    write_channels(layout);
+    write_global_layer_info(layout);
+}
+
+void PSDWriter::write_records(const PSDLayout& layout)
+{
     // Header section.
     write(m_data.header.file_signature);
-    write(m_data.header.version);
+    write(layout.version());
     write(m_data.header.reserved);
     write(m_data.header.channel_count);
     write(m_data.header.height);
@@ -51,7 +387,7 @@ PSDStatus PSDWriter::write(const std::filesystem::path& filepath, bool overwrite
     write(m_data.colour_mode_data.colour_mode_data_length);
 
     // Image resources section.
-    write(m_data.image_resources.length());
+    write(layout.image_resources_length);
 
     write(m_data.image_resources.resolution.signature);
     write(m_data.image_resources.resolution.uid);
@@ -93,29 +429,44 @@ PSDStatus PSDWriter::write(const std::filesystem::path& filepath, bool overwrite
         write(m_data.image_resources.grid_and_guides.padding);
     }
 
+    const VersionInfo& version_info{ m_data.image_resources.version_info };
+    if (!version_info.has_real_merged_data)
+    {
+        write(version_info.signature);
+        write(version_info.uid);
+        write(version_info.null_name);
+        write(version_info.length());
+        write(version_info.version);
+        write(version_info.has_real_merged_data);
+        for (const std::string* name : { &version_info.writer_name,
+            &version_info.reader_name })
+        {
+            // ASCII, so each character is a UTF-16 code unit.
+            write(static_cast<uint32_t>(name->size()));
+            for (char ch : *name)
+            {
+                write(static_cast<uint8_t>(0));
+                write(static_cast<uint8_t>(ch));
+            }
+        }
+        write(version_info.file_version);
+        if (version_info.length() % 2 != 0)
+            write(version_info.padding);
+    }
+
     // Layer and mask section.
-    write(m_data.layer_and_mask_info.layer_and_mask_info_length());
-    write(m_data.layer_and_mask_info.layer_info_length());
+    write_length(layout.layer_and_mask_info_length, layout.length_size());
+    write_length(layout.layer_info_length, layout.length_size());
     write(m_data.layer_and_mask_info.layer_count());
-    for (const LayerRecord& lr : m_data.layer_and_mask_info.layer_records)
+    for (size_t i{}; i < layout.layers.size(); ++i)
     {
+        const LayerRecord& lr{ m_data.layer_and_mask_info.layer_records[i] };
         write(lr.layer_content_rect);
         write(lr.channel_count);
-        if (lr.alpha_channel_info.length)
-        {
-            write(lr.alpha_channel_info);
-        }
-        if (lr.red_channel_info.length)
-        {
-            write(lr.red_channel_info);
-        }
-        if (lr.green_channel_info.length)
-        {
-            write(lr.green_channel_info);
-        }
-        if (lr.blue_channel_info.length)
+        for (const ChannelLayout& channel : layout.layers[i].channels)
         {
-            write(lr.blue_channel_info);
+            write(channel.id);
+            write_length(channel.length, layout.length_size());
         }
         write(lr.blend_mode_signature);
         write(lr.blend_mode_key);
@@ -123,7 +474,7 @@ PSDStatus PSDWriter::write(const std::filesystem::path& filepath, bool overwrite
         write(lr.clipping);
         write(lr.flags);
         write(lr.filler);
-        write(lr.extra_data_length());
+        write(layout.layers[i].extra_data_length);
         write(lr.layer_mask_data.length());
         if (lr.layer_mask_data.active)
         {
@@ -151,16 +502,58 @@ PSDStatus PSDWriter::write(const std::filesystem::path& filepath, bool overwrite
         write(lr.cust);
         write(lr.reference_point);
     }
+}
 
-    for (const auto& image_ptr : m_data.layer_and_mask_info.layer_image_data)
+void PSDWriter::write_channels(const PSDLayout& layout)
+{
+    /* Every channel's position is known in advance, so the bulk of the file
+    is handed over as independent spans. Bytecounts are converted to 
+    big-endian first, as they can't be written as they are. */
+    const auto& layer_image_data{ m_data.layer_and_mask_info.layer_image_data };
+    std::vector<std::vector<char>> channel_headers{};
+    std::vector<Span> spans{};
+    channel_headers.reserve(layer_image_data.size() * 4);
+    for (size_t i{}; i < layer_image_data.size(); ++i)
     {
-        for (const auto& channel : image_ptr->data())
+        const std::vector<PSDChannel>& channels{ layer_image_data[i]->data() };
+        if (channels.size() != layout.layers[i].channels.size())
+            m_failed = true;
+
+        for (size_t c{}; c < channels.size() && !m_failed; ++c)
         {
-            write(channel.compression);
-            write(channel.bytecounts);
-            write(channel.image_data);
+            channel_headers.push_back({});
+            channel_headers.back().reserve(sizeof(uint16_t)
+                + channels[c].bytecounts.size() * layout.bytecount_size());
+            big_endian(channels[c].compression, sizeof(uint16_t),
+                channel_headers.back());
+            for (uint32_t bytecount : channels[c].bytecounts)
+            {
+                big_endian(bytecount, layout.bytecount_size(),
+                    channel_headers.back());
+            }
+
+            const ChannelLayout& planned{ layout.layers[i].channels[c] };
+            if (channel_headers.back().size() + channels[c].image_data.size()
+                != planned.length)
+            {
+                m_failed = true;
+                break;
+            }
+            add_spans(spans, planned.offset,
+                channel_headers.back().data(), channel_headers.back().size());
+            add_spans(spans, planned.offset + channel_headers.back().size(),
+                reinterpret_cast<const char*>(channels[c].image_data.data()),
+                channels[c].image_data.size());
         }
     }
+    if (position() != layout.channel_data_offset)
+        m_failed = true;
+    write_spans(spans,
+        layout.channel_data_offset + layout.channel_data_length);
+}
+
+void PSDWriter::write_global_layer_info(const PSDLayout& layout)
+{
     write(m_data.layer_and_mask_info.mystery_null);
 
     if (m_data.layer_and_mask_info.global_layer_mask_info.active)
@@ -181,33 +574,174 @@ PSDStatus PSDWriter::write(const std::filesystem::path& filepath, bool overwrite
     }
     
     write(m_data.layer_and_mask_info.patterns);
-    write(m_data.layer_and_mask_info.filter_mask);
+    write(m_data.layer_and_mask_info.filter_mask.signature);
+    write(m_data.layer_and_mask_info.filter_mask.key);
+    write_length(m_data.layer_and_mask_info.filter_mask.length(),
+        layout.length_size());
+    write(m_data.layer_and_mask_info.filter_mask.data);
     write(m_data.layer_and_mask_info.compositor_info);
+}
 
-    // Image data section.
-    PSDCompressedImage compressed_merged_image_data{};
-    compressed_merged_image_data.load(
-        m_data.image_data.data(),
-        m_data.image_data.channels(),
-        m_data.image_data.width(),
-        m_data.image_data.height());
-
-    write(compressed_merged_image_data.data()[0].compression);
-    for (const auto& channel : compressed_merged_image_data.data())
-        write(channel.bytecounts);
-    for (const auto& channel : compressed_merged_image_data.data())
-        write(channel.image_data);
-
-    // Close writer and check for errors. PSD files should not exceed 2GiB.
-    auto file_size = m_writer.tellp();
-    m_writer.close();
-    if (m_writer.fail() || file_size >= 2147483648)
+void PSDWriter::write_image_data(const std::vector<uint32_t>& bytecounts,
+    const PSDLayout& layout)
+{
+    const uint16_t compression{ 1 };
+    write(compression);
+    write_bytecounts(bytecounts, layout.bytecount_size());
+
+    /* The rows were measured while planning. Bands that weren't kept then 
+    are packed again as they are written, a batch at a time, so at most 
+    the batch and the budget are held. */
+    const PSDRawImage& merged_image{ merged_source() };
+    const int width{ merged_image.width() };
+    const int height{ merged_image.height() };
+    const size_t rows{ bytecounts.size() };
+    const size_t band_rows{ std::max<size_t>(1,
+        band_size / std::max(1, width)) };
+    const size_t bands{ (rows + band_rows - 1) / band_rows };
+    const size_t batch_bands{ batch_size / band_size };
+    std::vector<std::vector<uint8_t>> packed(std::min(bands, batch_bands));
+    std::vector<size_t> lengths(packed.size());
+    uint64_t offset{ position() };
+    for (size_t first{}; first < bands; first += batch_bands)
     {
-        m_status = PSDStatus::FileWriteError;
-        std::filesystem::remove(filepath);
+        const size_t count{ std::min(batch_bands, bands - first) };
+        parallel_for(count, [&](size_t i)
+            {
+                if (first + i < m_packed_bands.size()
+                    && !m_packed_bands[first + i].empty())
+                {
+                    return;
+                }
+                const size_t begin{ (first + i) * band_rows };
+                const size_t end{ std::min(rows, begin + band_rows) };
+                size_t length{};
+                for (size_t r{ begin }; r < end; r++)
+                    length += bytecounts[r];
+                // The last row may be packed past its length.
+                packed[i].resize(length
+                    + PSDCompressedImage::max_packed_length(width));
+                std::vector<uint8_t> row(static_cast<size_t>(width));
+                PackedRow last{};
+                lengths[i] = 0;
+                for (size_t r{ begin }; r < end; r++)
+                {
+                    lengths[i] += pack_merged_row(merged_image,
+                        static_cast<int>(r / height),
+                        static_cast<int>(r % height), row.data(),
+                        packed[i].data() + lengths[i], last);
+                }
+            });
+
+        std::vector<Span> spans{};
+        for (size_t i{}; i < count; i++)
+        {
+            const bool kept{ first + i < m_packed_bands.size()
+                && !m_packed_bands[first + i].empty() };
+            const std::vector<uint8_t>& band{ kept
+                ? m_packed_bands[first + i] : packed[i] };
+            const size_t length{ kept ? band.size() : lengths[i] };
+            add_spans(spans, offset,
+                reinterpret_cast<const char*>(band.data()), length);
+            offset += length;
+        }
+        write_spans(spans, offset);
+        for (size_t i{}; i < count && first + i < m_packed_bands.size(); i++)
+            std::vector<uint8_t>().swap(m_packed_bands[first + i]);
     }
+    m_packed_bands.clear();
+}
 
-    return m_status;
+void PSDWriter::add_spans(std::vector<Span>& spans, uint64_t offset,
+    const char* data, size_t size)
+{
+    // Split large blocks so that the work is shared evenly between threads.
+    while (size > 0)
+    {
+        size_t span_size{ std::min(size, span_size_limit) };
+        spans.push_back({ offset, data, span_size });
+        offset += span_size;
+        data += span_size;
+        size -= span_size;
+    }
+}
+
+void PSDWriter::write_spans(const std::vector<Span>& spans, uint64_t end)
+{
+    if (!m_output->concurrent())
+    {
+        // Spans are in file order, so they can go through the buffer.
+        for (const Span& span : spans)
+        {
+            if (position() != span.offset)
+                m_failed = true;
+            append(span.data, span.size);
+        }
+        if (position() != end)
+            m_failed = true;
+        return;
+    }
+
+    flush();
+    if (!m_failed)
+    {
+        std::atomic<bool> success{ true };
+        parallel_for(spans.size(), [&](size_t i)
+            {
+                if (!m_output->write(
+                    spans[i].offset, spans[i].data, spans[i].size))
+                {
+                    success = false;
+                }
+            });
+        if (!success)
+            m_failed = true;
+    }
+    m_offset = end;
+}
+
+void PSDWriter::big_endian(uint64_t val, size_t size, std::vector<char>& out)
+{
+    for (size_t i{ size }; i > 0; --i)
+        out.push_back(static_cast<char>(val >> (i - 1) * 8));
+}
+
+uint64_t PSDWriter::position() const
+{
+    return m_offset + m_buffer_pos;
+}
+
+void PSDWriter::append(const char* data, size_t size)
+{
+    // Empty sections may have no data at all.
+    if (size == 0)
+        return;
+    if (m_buffer_pos + size > m_buffer.size())
+    {
+        flush();
+
+        // Large payloads bypass the buffer entirely.
+        if (size >= m_buffer.size())
+        {
+            if (!m_failed && !m_output->write(m_offset, data, size))
+                m_failed = true;
+            m_offset += size;
+            return;
+        }
+    }
+
+    std::memcpy(m_buffer.data() + m_buffer_pos, data, size);
+    m_buffer_pos += size;
+}
+
+void PSDWriter::flush()
+{
+    if (m_buffer_pos == 0)
+        return;
+    if (!m_failed && !m_output->write(m_offset, m_buffer.data(), m_buffer_pos))
+        m_failed = true;
+    m_offset += m_buffer_pos;
+    m_buffer_pos = 0;
 }
 
 constexpr bool PSDWriter::little_endian()
@@ -224,8 +758,9 @@ constexpr bool PSDWriter::little_endian()
 
 void PSDWriter::write(const uint8_t& val)
 {
-    char buffer[sizeof(val)]{ static_cast<char>(val) };
-    m_writer.write(buffer, sizeof(val));
+    if (m_buffer_pos == m_buffer.size())
+        flush();
+    m_buffer[m_buffer_pos++] = static_cast<char>(val);
 }
 
 void PSDWriter::write(const uint16_t& val)
@@ -244,7 +779,7 @@ void PSDWriter::write(const uint16_t& val)
         buffer[1] = (val >> 8);
     }
 
-    m_writer.write(buffer, sizeof(val));
+    append(buffer, sizeof(val));
 }
 
 void PSDWriter::write(const int16_t& val)
@@ -272,7 +807,7 @@ void PSDWriter::write(const uint32_t& val)
         buffer[3] = (val & 0xff000000) >> 24;
     }
 
-    m_writer.write(buffer, sizeof(val));
+    append(buffer, sizeof(val));
 }
 
 void PSDWriter::write(const int32_t& val)
@@ -280,6 +815,20 @@ void PSDWriter::write(const int32_t& val)
     write(static_cast<uint32_t>(val));
 }
 
+void PSDWriter::write(const uint64_t& val)
+{
+    write(static_cast<uint32_t>(val >> 32));
+    write(static_cast<uint32_t>(val & 0xffffffff));
+}
+
+void PSDWriter::write_length(uint64_t val, size_t size)
+{
+    if (size == sizeof(uint64_t))
+        write(val);
+    else
+        write(static_cast<uint32_t>(val));
+}
+
 void PSDWriter::write(const double& val)
 {
     char buffer[sizeof(val)]{ 0 };
@@ -309,37 +858,55 @@ void PSDWriter::write(const double& val)
         buffer[7] = static_cast<char>((temp_val & 0xff00000000000000) >> 56);
     }
 
-    m_writer.write(buffer, sizeof(val));
+    append(buffer, sizeof(val));
 }
 
 void PSDWriter::write_with_null(const double& val)
 {
     write(val);
-    char buffer[1]{ 0 };
-
-    m_writer.write(buffer, 1);
+    write(static_cast<uint8_t>(0));
 }
 
 void PSDWriter::write(const std::vector<char>& val)
 {
-    m_writer.write(val.data(), val.size());
+    append(val.data(), val.size());
 }
 
 void PSDWriter::write(const std::vector<uint8_t>& val)
 {
-    for (uint8_t i : val)
-        write(i);
+    append(reinterpret_cast<const char*>(val.data()), val.size());
 }
 
-void PSDWriter::write(const std::vector<uint16_t>& val)
+void PSDWriter::write_bytecounts(const std::vector<uint32_t>& val,
+    size_t size)
 {
-    for (uint16_t i : val)
-        write(i);
+    // Convert to big-endian directly in the output buffer, one block at a
+    // time. Shifting is independent of the host byte order.
+    size_t i{};
+    while (i < val.size())
+    {
+        if (m_buffer.size() - m_buffer_pos < size)
+            flush();
+
+        size_t block{ std::min(val.size() - i,
+            (m_buffer.size() - m_buffer_pos) / size) };
+        char* out{ m_buffer.data() + m_buffer_pos };
+        for (size_t j{}; j < block; j++)
+        {
+            for (size_t b{}; b < size; b++)
+            {
+                out[j * size + b] = static_cast<char>(
+                    val[i + j] >> (size - 1 - b) * 8);
+            }
+        }
+        m_buffer_pos += block * size;
+        i += block;
+    }
 }
 
 void PSDWriter::write(const std::string& val)
 {
-    m_writer.write(val.data(), val.size());
+    append(val.data(), val.size());
 }
 
 void PSDWriter::write(const PascalString& val)
@@ -357,12 +924,6 @@ void PSDWriter::write(const LayerRect& val)
     write(val.right);
 }
 
-void PSDWriter::write(const ChannelInfo& val)
-{
-    write(val.id);
-    write(val.length);
-}
-
 void PSDWriter::write(const LayerBlendingRanges& val)
 {
     write(val.src_black_lower);
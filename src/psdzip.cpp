@@ -0,0 +1,1124 @@
+// Copyright (c) 2024 Dan Kemp. All rights reserved.
+// This source code is licensed under the MIT license found in the 
+// LICENSE file in the root directory of this source tree.
+
+#include "psdzip.hpp"
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+#include <array>
+#include <utility>
+#include <algorithm>
+#include <bit>
+
+using namespace psdimpl;
+
+// Deflate alphabets, shared by the encoder and decoder.
+static constexpr int min_match{ 3 };
+static constexpr int max_match{ 258 };
+static constexpr int literal_codes{ 286 };
+static constexpr int distance_codes{ 30 };
+static constexpr int end_of_block{ 256 };
+
+static constexpr uint16_t length_base[29]{ 3, 4, 5, 6, 7, 8, 9, 10, 11, 13,
+    15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195,
+    227, 258 };
+static constexpr uint8_t length_extra[29]{ 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1,
+    1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static constexpr uint16_t distance_base[30]{ 1, 2, 3, 4, 5, 7, 9, 13, 17, 25,
+    33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073,
+    4097, 6145, 8193, 12289, 16385, 24577 };
+static constexpr uint8_t distance_extra[30]{ 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4,
+    4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+// The order code length code lengths are sent in.
+static constexpr uint8_t code_length_order[19]{ 16, 17, 18, 0, 8, 7, 9, 6,
+    10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+static int length_code(int length)
+{
+    // Codes 257 to 264 are exact, after which each pair of bits doubles.
+    int l{ length - min_match };
+    if (l < 8)
+        return l;
+    if (length == max_match)
+        return 28;
+    int n{ static_cast<int>(std::bit_width(static_cast<unsigned>(l))) - 1 };
+    return 4 * (n - 1) + ((l >> (n - 2)) & 3);
+}
+
+static int distance_code(int distance)
+{
+    int d{ distance - 1 };
+    if (d < 4)
+        return d;
+    int n{ static_cast<int>(std::bit_width(static_cast<unsigned>(d))) - 1 };
+    return 2 * n + ((d >> (n - 1)) & 1);
+}
+
+static void fixed_lengths(uint8_t* literals, uint8_t* distances)
+{
+    for (int i{}; i < 288; i++)
+        literals[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+    for (int i{}; i < 32; i++)
+        distances[i] = 5;
+}
+
+class PSDZip::Deflater
+{
+public:
+    Deflater(const uint8_t* data, size_t size, int level)
+        : m_data{ data }
+        , m_size{ size }
+        , m_config{ configs[std::clamp(level, 0, max_level)] }
+        , m_level{ std::clamp(level, 0, max_level) }
+    {
+    }
+
+    void run(std::vector<uint8_t>& out)
+    {
+        m_out = &out;
+        m_symbols.reserve(block_symbols);
+        if (m_level == 0)
+        {
+            m_emitted = m_size;
+            flush_block(true);
+        }
+        else if (m_level <= 3)
+        {
+            run_greedy();
+        }
+        else
+        {
+            run_lazy();
+        }
+    }
+
+private:
+    // Matching effort, as zlib's configuration table.
+    struct Config
+    {
+        int good; // Search less once a match this long is found.
+        int lazy; // Don't look for a better match beyond this length.
+        int nice; // Stop searching at this length.
+        int chain; // Most candidates to try.
+    };
+
+    static constexpr Config configs[10]{ { 0, 0, 0, 0 }, { 4, 4, 8, 4 },
+        { 4, 5, 16, 8 }, { 4, 6, 32, 32 }, { 4, 4, 16, 16 },
+        { 8, 16, 32, 32 }, { 8, 16, 128, 128 }, { 8, 32, 128, 256 },
+        { 32, 128, 258, 1024 }, { 32, 258, 258, 4096 } };
+
+    static constexpr size_t window_size{ 1 << 15 };
+    static constexpr size_t window_mask{ window_size - 1 };
+    /* Matches stop short of the full window, so a position's chain link is
+    never overwritten while it can still be reached. */
+    static constexpr size_t max_distance{ window_size - max_match - 4 };
+    static constexpr int hash_bits{ 15 };
+    // Symbols per block, after which the block's codes are rebuilt.
+    static constexpr size_t block_symbols{ 1 << 14 };
+    // Longest stored block.
+    static constexpr size_t max_stored{ 65535 };
+
+    // A literal, when distance is 0, or a match.
+    struct Symbol
+    {
+        uint16_t value;
+        uint16_t distance;
+    };
+
+    // Insert the string at pos, returning the previous one with its hash.
+    int64_t insert(size_t pos)
+    {
+        uint32_t val{ static_cast<uint32_t>(m_data[pos])
+            | static_cast<uint32_t>(m_data[pos + 1]) << 8
+            | static_cast<uint32_t>(m_data[pos + 2]) << 16 };
+        uint32_t hash{ (val * 2654435761u) >> (32 - hash_bits) };
+        int64_t previous{ m_head[hash] };
+        m_prev[pos & window_mask] = previous;
+        m_head[hash] = static_cast<int64_t>(pos);
+        return previous;
+    }
+
+    int match_length(const uint8_t* a, const uint8_t* b, int limit) const
+    {
+        int length{};
+        if constexpr (std::endian::native == std::endian::little)
+        {
+            while (length + 8 <= limit)
+            {
+                uint64_t x, y;
+                std::memcpy(&x, a + length, sizeof(x));
+                std::memcpy(&y, b + length, sizeof(y));
+                if (x != y)
+                    return length + std::countr_zero(x ^ y) / 8;
+                length += 8;
+            }
+        }
+        while (length < limit && a[length] == b[length])
+            length++;
+        return length;
+    }
+
+    /* Longest match for pos along the chain from candidate, if it is longer
+    than best. */
+    int longest_match(size_t pos, int64_t candidate, int best,
+        size_t& distance) const
+    {
+        int chain{ m_config.chain };
+        if (best >= m_config.good)
+            chain >>= 2;
+        const int limit{ static_cast<int>(
+            std::min<size_t>(max_match, m_size - pos)) };
+        best = std::max(best, min_match - 1);
+        if (best >= limit)
+            return best;
+
+        const int64_t lowest{ pos > max_distance
+            ? static_cast<int64_t>(pos - max_distance) : 0 };
+        const uint8_t* current{ m_data + pos };
+        while (candidate >= lowest && chain-- > 0)
+        {
+            const uint8_t* match{ m_data + candidate };
+            if (match[best] == current[best] && match[0] == current[0]
+                && match[1] == current[1])
+            {
+                int length{ match_length(match, current, limit) };
+                if (length > best)
+                {
+                    best = length;
+                    distance = pos - static_cast<size_t>(candidate);
+                    if (length >= m_config.nice || length >= limit)
+                        break;
+                }
+            }
+            candidate = m_prev[static_cast<size_t>(candidate) & window_mask];
+        }
+
+        return best;
+    }
+
+    // zlib's fast strategy, taking the first match found at each position.
+    void run_greedy()
+    {
+        size_t pos{};
+        while (pos < m_size)
+        {
+            int length{};
+            size_t distance{};
+            if (pos + min_match <= m_size)
+                length = longest_match(pos, insert(pos), 0, distance);
+
+            if (length >= min_match && distance)
+            {
+                add_match(length, distance);
+                // Only short matches are hashed throughout, for speed.
+                if (length <= m_config.lazy)
+                {
+                    for (size_t p{ pos + 1 }; p < pos + length
+                        && p + min_match <= m_size; p++)
+                    {
+                        insert(p);
+                    }
+                }
+                pos += length;
+            }
+            else
+            {
+                add_literal(m_data[pos]);
+                pos++;
+            }
+        }
+        flush_block(true);
+    }
+
+    /* zlib's slow strategy. A match is only taken if the next position
+    doesn't start a longer one. */
+    void run_lazy()
+    {
+        size_t pos{};
+        bool pending{ false };
+        int previous_length{ min_match - 1 };
+        size_t previous_distance{};
+        while (true)
+        {
+            int length{ min_match - 1 };
+            size_t distance{};
+            if (pos + min_match <= m_size)
+            {
+                int64_t candidate{ insert(pos) };
+                if (previous_length < m_config.lazy)
+                {
+                    length = longest_match(pos, candidate, previous_length,
+                        distance);
+                    // A short, distant match costs more than its literals.
+                    if (!distance || (length == min_match && distance > 4096))
+                        length = min_match - 1;
+                }
+            }
+
+            if (pending && previous_length >= min_match
+                && length <= previous_length)
+            {
+                add_match(previous_length, previous_distance);
+                size_t end{ pos - 1 + previous_length };
+                for (size_t p{ pos + 1 }; p < end && p + min_match <= m_size;
+                    p++)
+                {
+                    insert(p);
+                }
+                pos = end;
+                pending = false;
+                previous_length = min_match - 1;
+                if (pos >= m_size)
+                    break;
+                continue;
+            }
+
+            if (pending)
+                add_literal(m_data[pos - 1]);
+            if (pos >= m_size)
+                break;
+            pending = true;
+            previous_length = length;
+            previous_distance = distance;
+            pos++;
+        }
+        flush_block(true);
+    }
+
+    void add_literal(uint8_t val)
+    {
+        m_symbols.push_back({ val, 0 });
+        m_literal_freqs[val]++;
+        m_emitted++;
+        if (m_symbols.size() == block_symbols)
+            flush_block(false);
+    }
+
+    void add_match(int length, size_t distance)
+    {
+        m_symbols.push_back({ static_cast<uint16_t>(length),
+            static_cast<uint16_t>(distance) });
+        m_literal_freqs[257 + length_code(length)]++;
+        m_distance_freqs[distance_code(static_cast<int>(distance))]++;
+        m_emitted += length;
+        if (m_symbols.size() == block_symbols)
+            flush_block(false);
+    }
+
+    /* Huffman code lengths for freqs, no longer than max_bits. Lengths come
+    from Moffat and Katajainen's in-place algorithm, and are then limited by
+    moving codes down the tree until the Kraft sum balances. At least two
+    codes are always given, so every tree is complete. */
+    static void build_lengths(const uint32_t* freqs, int count, int max_bits,
+        uint8_t* lengths)
+    {
+        std::vector<std::pair<uint32_t, int>> symbols;
+        for (int i{}; i < count; i++)
+        {
+            lengths[i] = 0;
+            if (freqs[i])
+                symbols.push_back({ freqs[i], i });
+        }
+        if (symbols.size() < 2)
+        {
+            int used{ symbols.empty() ? 0 : symbols[0].second };
+            lengths[used] = 1;
+            lengths[used == 0 ? 1 : 0] = 1;
+            return;
+        }
+        std::stable_sort(symbols.begin(), symbols.end(),
+            [](const auto& a, const auto& b) { return a.first < b.first; });
+
+        const int n{ static_cast<int>(symbols.size()) };
+        std::vector<uint32_t> a(n);
+        for (int i{}; i < n; i++)
+            a[i] = symbols[i].first;
+
+        a[0] += a[1];
+        int root{}, leaf{ 2 };
+        for (int next{ 1 }; next < n - 1; next++)
+        {
+            if (leaf >= n || a[root] < a[leaf])
+            {
+                a[next] = a[root];
+                a[root++] = next;
+            }
+            else
+            {
+                a[next] = a[leaf++];
+            }
+            if (leaf >= n || (root < next && a[root] < a[leaf]))
+            {
+                a[next] += a[root];
+                a[root++] = next;
+            }
+            else
+            {
+                a[next] += a[leaf++];
+            }
+        }
+        a[n - 2] = 0;
+        for (int next{ n - 3 }; next >= 0; next--)
+            a[next] = a[a[next]] + 1;
+        int available{ 1 }, used{}, depth{};
+        root = n - 2;
+        int next{ n - 1 };
+        while (available > 0)
+        {
+            while (root >= 0 && static_cast<int>(a[root]) == depth)
+            {
+                used++;
+                root--;
+            }
+            while (available > used)
+            {
+                a[next--] = depth;
+                available--;
+            }
+            available = 2 * used;
+            depth++;
+            used = 0;
+        }
+
+        std::array<int, 33> lengths_used{};
+        for (int i{}; i < n; i++)
+            lengths_used[std::min<uint32_t>(a[i], max_bits)]++;
+        uint32_t kraft{};
+        for (int i{ max_bits }; i > 0; i--)
+            kraft += static_cast<uint32_t>(lengths_used[i]) << (max_bits - i);
+        while (kraft != (1u << max_bits))
+        {
+            lengths_used[max_bits]--;
+            for (int i{ max_bits - 1 }; i > 0; i--)
+            {
+                if (lengths_used[i])
+                {
+                    lengths_used[i]--;
+                    lengths_used[i + 1] += 2;
+                    break;
+                }
+            }
+            kraft--;
+        }
+
+        // The most frequent symbols take the shortest codes.
+        int symbol{ n };
+        for (int length{ 1 }; length <= max_bits; length++)
+        {
+            for (int i{ lengths_used[length] }; i > 0; i--)
+                lengths[symbols[--symbol].second] = static_cast<uint8_t>(length);
+        }
+    }
+
+    // Canonical codes for lengths, bit reversed as deflate sends them.
+    static void build_codes(const uint8_t* lengths, int count, uint16_t* codes)
+    {
+        std::array<uint16_t, 16> length_counts{};
+        for (int i{}; i < count; i++)
+            length_counts[lengths[i]]++;
+        length_counts[0] = 0;
+        std::array<uint16_t, 16> next_code{};
+        uint16_t code{};
+        for (int bits{ 1 }; bits < 16; bits++)
+        {
+            code = static_cast<uint16_t>((code + length_counts[bits - 1]) << 1);
+            next_code[bits] = code;
+        }
+        for (int i{}; i < count; i++)
+        {
+            int length{ lengths[i] };
+            if (!length)
+                continue;
+            uint16_t val{ next_code[length]++ };
+            uint16_t reversed{};
+            for (int b{}; b < length; b++)
+                reversed |= ((val >> b) & 1) << (length - 1 - b);
+            codes[i] = reversed;
+        }
+    }
+
+    // Bits needed for the block's symbols with the given code lengths.
+    uint64_t data_bits(const uint8_t* literals, const uint8_t* distances) const
+    {
+        uint64_t bits{};
+        for (int i{}; i < literal_codes; i++)
+        {
+            bits += static_cast<uint64_t>(m_literal_freqs[i]) * literals[i];
+            if (i > end_of_block)
+                bits += static_cast<uint64_t>(m_literal_freqs[i])
+                    * length_extra[i - 257];
+        }
+        for (int i{}; i < distance_codes; i++)
+        {
+            bits += static_cast<uint64_t>(m_distance_freqs[i])
+                * (distances[i] + distance_extra[i]);
+        }
+        return bits;
+    }
+
+    void flush_block(bool last)
+    {
+        m_literal_freqs[end_of_block]++;
+
+        // Dynamic codes, with their lengths run-length encoded.
+        uint8_t literal_lengths[288]{};
+        uint8_t distance_lengths[32]{};
+        build_lengths(m_literal_freqs.data(), literal_codes, 15,
+            literal_lengths);
+        build_lengths(m_distance_freqs.data(), distance_codes, 15,
+            distance_lengths);
+        int literal_count{ literal_codes };
+        while (literal_count > 257 && !literal_lengths[literal_count - 1])
+            literal_count--;
+        int distance_count{ distance_codes };
+        while (distance_count > 1 && !distance_lengths[distance_count - 1])
+            distance_count--;
+
+        std::vector<uint8_t> all_lengths(literal_lengths,
+            literal_lengths + literal_count);
+        all_lengths.insert(all_lengths.end(), distance_lengths,
+            distance_lengths + distance_count);
+        std::vector<std::pair<uint8_t, uint8_t>> length_symbols;
+        std::array<uint32_t, 19> length_freqs{};
+        for (size_t i{}; i < all_lengths.size();)
+        {
+            uint8_t val{ all_lengths[i] };
+            size_t run{ 1 };
+            while (i + run < all_lengths.size() && all_lengths[i + run] == val)
+                run++;
+            i += run;
+            if (val == 0)
+            {
+                while (run >= 11)
+                {
+                    size_t n{ std::min<size_t>(run, 138) };
+                    length_symbols.push_back({ 18,
+                        static_cast<uint8_t>(n - 11) });
+                    run -= n;
+                }
+                if (run >= 3)
+                {
+                    length_symbols.push_back({ 17,
+                        static_cast<uint8_t>(run - 3) });
+                    run = 0;
+                }
+            }
+            else
+            {
+                length_symbols.push_back({ val, 0 });
+                run--;
+                while (run >= 3)
+                {
+                    size_t n{ std::min<size_t>(run, 6) };
+                    length_symbols.push_back({ 16,
+                        static_cast<uint8_t>(n - 3) });
+                    run -= n;
+                }
+            }
+            for (; run > 0; run--)
+                length_symbols.push_back({ val, 0 });
+        }
+        for (const auto& symbol : length_symbols)
+            length_freqs[symbol.first]++;
+        uint8_t length_lengths[19]{};
+        build_lengths(length_freqs.data(), 19, 7, length_lengths);
+        int length_count{ 19 };
+        while (length_count > 4
+            && !length_lengths[code_length_order[length_count - 1]])
+        {
+            length_count--;
+        }
+
+        uint64_t dynamic_bits{ 3 + 5 + 5 + 4 + 3 * length_count
+            + data_bits(literal_lengths, distance_lengths) };
+        for (int i{}; i < 19; i++)
+            dynamic_bits += static_cast<uint64_t>(length_freqs[i])
+                * length_lengths[i];
+        dynamic_bits += length_freqs[16] * 2 + length_freqs[17] * 3
+            + length_freqs[18] * 7;
+
+        uint8_t fixed_literals[288];
+        uint8_t fixed_distances[32];
+        fixed_lengths(fixed_literals, fixed_distances);
+        uint64_t fixed_bits{ 3 + data_bits(fixed_literals, fixed_distances) };
+
+        const size_t stored_size{ m_emitted - m_block_start };
+        const uint64_t stored_bits{ (stored_size / max_stored + 1) * (3 + 7 + 32)
+            + static_cast<uint64_t>(stored_size) * 8 };
+
+        if (m_level == 0
+            || (stored_bits <= fixed_bits && stored_bits <= dynamic_bits))
+        {
+            write_stored(last);
+        }
+        else if (fixed_bits <= dynamic_bits)
+        {
+            put_bits(last ? 1 : 0, 1);
+            put_bits(1, 2);
+            write_symbols(fixed_literals, fixed_distances);
+        }
+        else
+        {
+            put_bits(last ? 1 : 0, 1);
+            put_bits(2, 2);
+            put_bits(literal_count - 257, 5);
+            put_bits(distance_count - 1, 5);
+            put_bits(length_count - 4, 4);
+            for (int i{}; i < length_count; i++)
+                put_bits(length_lengths[code_length_order[i]], 3);
+            uint16_t length_codes[19]{};
+            build_codes(length_lengths, 19, length_codes);
+            for (const auto& symbol : length_symbols)
+            {
+                put_bits(length_codes[symbol.first],
+                    length_lengths[symbol.first]);
+                if (symbol.first == 16)
+                    put_bits(symbol.second, 2);
+                else if (symbol.first == 17)
+                    put_bits(symbol.second, 3);
+                else if (symbol.first == 18)
+                    put_bits(symbol.second, 7);
+            }
+            write_symbols(literal_lengths, distance_lengths);
+        }
+
+        if (last)
+            align();
+
+        m_symbols.clear();
+        m_literal_freqs.fill(0);
+        m_distance_freqs.fill(0);
+        m_block_start = m_emitted;
+    }
+
+    void write_symbols(const uint8_t* literal_lengths,
+        const uint8_t* distance_lengths)
+    {
+        uint16_t literal_codes_out[288]{};
+        uint16_t distance_codes_out[32]{};
+        build_codes(literal_lengths, 288, literal_codes_out);
+        build_codes(distance_lengths, 32, distance_codes_out);
+        for (const Symbol& symbol : m_symbols)
+        {
+            if (!symbol.distance)
+            {
+                put_bits(literal_codes_out[symbol.value],
+                    literal_lengths[symbol.value]);
+                continue;
+            }
+            int code{ length_code(symbol.value) };
+            put_bits(literal_codes_out[257 + code],
+                literal_lengths[257 + code]);
+            put_bits(symbol.value - length_base[code], length_extra[code]);
+            code = distance_code(symbol.distance);
+            put_bits(distance_codes_out[code], distance_lengths[code]);
+            put_bits(symbol.distance - distance_base[code],
+                distance_extra[code]);
+        }
+        put_bits(literal_codes_out[end_of_block],
+            literal_lengths[end_of_block]);
+    }
+
+    void write_stored(bool last)
+    {
+        size_t start{ m_block_start };
+        do
+        {
+            size_t length{ std::min(max_stored, m_emitted - start) };
+            bool final{ last && start + length == m_emitted };
+            put_bits(final ? 1 : 0, 1);
+            put_bits(0, 2);
+            align();
+            put_bits(static_cast<uint32_t>(length), 16);
+            put_bits(static_cast<uint32_t>(~length & 0xffff), 16);
+            m_out->insert(m_out->end(), m_data + start, m_data + start + length);
+            start += length;
+        } while (start < m_emitted);
+    }
+
+    void put_bits(uint32_t bits, int count)
+    {
+        m_bit_buffer |= static_cast<uint64_t>(bits) << m_bit_count;
+        m_bit_count += count;
+        if (m_bit_count >= 32)
+        {
+            for (int i{}; i < 4; i++)
+                m_out->push_back(static_cast<uint8_t>(m_bit_buffer >> (8 * i)));
+            m_bit_buffer >>= 32;
+            m_bit_count -= 32;
+        }
+    }
+
+    // Flush to a byte boundary.
+    void align()
+    {
+        while (m_bit_count > 0)
+        {
+            m_out->push_back(static_cast<uint8_t>(m_bit_buffer));
+            m_bit_buffer >>= 8;
+            m_bit_count -= 8;
+        }
+        m_bit_buffer = 0;
+        m_bit_count = 0;
+    }
+
+    const uint8_t* m_data;
+    const size_t m_size;
+    const Config m_config;
+    const int m_level;
+    std::vector<uint8_t>* m_out{};
+    std::vector<int64_t> m_head = std::vector<int64_t>(1 << hash_bits, -1);
+    std::vector<int64_t> m_prev = std::vector<int64_t>(window_size, -1);
+    std::vector<Symbol> m_symbols{};
+    std::array<uint32_t, literal_codes> m_literal_freqs{};
+    std::array<uint32_t, distance_codes> m_distance_freqs{};
+    size_t m_emitted{}; // Bytes of input covered by symbols so far.
+    size_t m_block_start{};
+    uint64_t m_bit_buffer{};
+    int m_bit_count{};
+};
+
+PSDZip::Inflater::Inflater(const uint8_t* data, size_t size)
+{
+    // Deflate with a window of at most 32KiB, and no preset dictionary.
+    if (size < 6 || (data[0] & 0x0f) != 8 || (data[0] >> 4) > 7
+        || (data[0] * 256 + data[1]) % 31 || (data[1] & 0x20))
+    {
+        m_failed = true;
+        return;
+    }
+    m_data = data + 2;
+    m_size = size - 2;
+}
+
+bool PSDZip::Inflater::read(uint8_t* out, size_t size)
+{
+    if (m_failed)
+        return false;
+    m_out = out;
+    m_out_size = size;
+    m_written = 0;
+    if (!inflate(false))
+    {
+        m_failed = true;
+        return false;
+    }
+
+    // Keep what later matches may still refer to.
+    m_checksum = adler32(out, size, m_checksum);
+    m_total += size;
+    if (size >= window_size)
+    {
+        m_window.assign(out + size - window_size, out + size);
+    }
+    else
+    {
+        m_window.insert(m_window.end(), out, out + size);
+        if (m_window.size() > window_size)
+            m_window.erase(m_window.begin(),
+                m_window.end() - window_size);
+    }
+    return true;
+}
+
+bool PSDZip::Inflater::finish()
+{
+    if (m_failed)
+        return false;
+    m_out = nullptr;
+    m_out_size = 0;
+    m_written = 0;
+    if (!inflate(true))
+    {
+        m_failed = true;
+        return false;
+    }
+
+    // The Adler-32 trailer follows, from the next byte.
+    align();
+    uint32_t checksum{};
+    for (int i{}; i < 4; i++)
+        checksum = checksum << 8 | bits(8);
+    return !m_overrun && checksum == m_checksum;
+}
+
+bool PSDZip::Inflater::inflate(bool to_end)
+{
+    while (true)
+    {
+        const bool full{ m_written == m_out_size };
+        if (full && !to_end)
+            return true;
+
+        bool ok{ true };
+        if (m_match_length)
+        {
+            ok = !full;
+            if (ok)
+                copy_match();
+        }
+        else if (m_state == State::Stored)
+        {
+            ok = stored();
+        }
+        else if (m_state == State::Codes)
+        {
+            ok = codes(to_end);
+        }
+        else if (m_last)
+        {
+            // Short of out being filled, unless the end was wanted.
+            return to_end;
+        }
+        else
+        {
+            ok = header();
+        }
+        if (!ok || m_overrun)
+            return false;
+    }
+}
+
+bool PSDZip::Inflater::header()
+{
+    m_last = bits(1);
+    uint32_t type{ bits(2) };
+    if (type == 0)
+    {
+        align();
+        uint32_t length{ bits(16) };
+        uint32_t complement{ bits(16) };
+        if (m_overrun || (length ^ 0xffff) != complement)
+            return false;
+
+        // Return whole bytes still buffered to the input, to copy directly.
+        m_position -= m_bit_count / 8;
+        m_bit_buffer = 0;
+        m_bit_count = 0;
+        m_padding = 0;
+        m_stored_length = length;
+        m_state = State::Stored;
+        return true;
+    }
+
+    bool ok{ false };
+    if (type == 1)
+    {
+        uint8_t literals[288];
+        uint8_t distances[32];
+        fixed_lengths(literals, distances);
+        ok = build(m_literals, literals, 288)
+            && build(m_distances, distances, 32);
+    }
+    else if (type == 2)
+    {
+        ok = dynamic();
+    }
+    m_state = State::Codes;
+    return ok;
+}
+
+bool PSDZip::Inflater::build(Table& table, const uint8_t* lengths, int count)
+{
+    std::array<int, 16> length_counts{};
+    for (int i{}; i < count; i++)
+        length_counts[lengths[i]]++;
+    length_counts[0] = 0;
+
+    int max_bits{};
+    int left{ 1 };
+    for (int bits{ 1 }; bits < 16; bits++)
+    {
+        left = (left << 1) - length_counts[bits];
+        if (left < 0)
+            return false; // Over-subscribed.
+        if (length_counts[bits])
+            max_bits = bits;
+    }
+
+    table.bits = std::max(max_bits, 1);
+    table.entries.assign(size_t{ 1 } << table.bits, 0);
+    std::array<uint16_t, 16> next_code{};
+    uint16_t code{};
+    for (int bits{ 1 }; bits < 16; bits++)
+    {
+        code = static_cast<uint16_t>((code + length_counts[bits - 1]) << 1);
+        next_code[bits] = code;
+    }
+    for (int symbol{}; symbol < count; symbol++)
+    {
+        int length{ lengths[symbol] };
+        if (!length)
+            continue;
+        uint16_t val{ next_code[length]++ };
+        size_t reversed{};
+        for (int b{}; b < length; b++)
+            reversed |= static_cast<size_t>((val >> b) & 1) << (length - 1 - b);
+        for (size_t i{ reversed }; i < table.entries.size();
+            i += size_t{ 1 } << length)
+        {
+            table.entries[i] = static_cast<uint16_t>(symbol << 4 | length);
+        }
+    }
+    return true;
+}
+
+int PSDZip::Inflater::decode(const Table& table)
+{
+    refill(table.bits);
+    uint16_t entry{ table.entries[m_bit_buffer
+        & ((uint64_t{ 1 } << table.bits) - 1)] };
+    int length{ entry & 15 };
+    if (!length)
+        return -1;
+    consume(length);
+    return entry >> 4;
+}
+
+bool PSDZip::Inflater::dynamic()
+{
+    int literal_count{ static_cast<int>(bits(5)) + 257 };
+    int distance_count{ static_cast<int>(bits(5)) + 1 };
+    int length_count{ static_cast<int>(bits(4)) + 4 };
+    if (literal_count > literal_codes || distance_count > distance_codes)
+        return false;
+
+    uint8_t length_lengths[19]{};
+    for (int i{}; i < length_count; i++)
+        length_lengths[code_length_order[i]] = static_cast<uint8_t>(bits(3));
+    Table length_table;
+    if (!build(length_table, length_lengths, 19))
+        return false;
+
+    uint8_t lengths[literal_codes + distance_codes]{};
+    int count{ literal_count + distance_count };
+    for (int i{}; i < count;)
+    {
+        int symbol{ decode(length_table) };
+        if (symbol < 0)
+            return false;
+        if (symbol < 16)
+        {
+            lengths[i++] = static_cast<uint8_t>(symbol);
+            continue;
+        }
+        uint8_t val{};
+        int repeat{};
+        if (symbol == 16)
+        {
+            if (i == 0)
+                return false;
+            val = lengths[i - 1];
+            repeat = 3 + static_cast<int>(bits(2));
+        }
+        else if (symbol == 17)
+        {
+            repeat = 3 + static_cast<int>(bits(3));
+        }
+        else
+        {
+            repeat = 11 + static_cast<int>(bits(7));
+        }
+        if (i + repeat > count)
+            return false;
+        while (repeat--)
+            lengths[i++] = val;
+    }
+    if (!lengths[end_of_block])
+        return false;
+
+    return build(m_literals, lengths, literal_count)
+        && build(m_distances, lengths + literal_count, distance_count);
+}
+
+bool PSDZip::Inflater::codes(bool to_end)
+{
+    while (true)
+    {
+        if (m_written == m_out_size && !to_end)
+            return true;
+        int symbol{ decode(m_literals) };
+        if (symbol < 0 || m_overrun)
+            return false;
+        if (symbol < end_of_block)
+        {
+            if (m_written == m_out_size)
+                return false;
+            m_out[m_written++] = static_cast<uint8_t>(symbol);
+            continue;
+        }
+        if (symbol == end_of_block)
+        {
+            m_state = State::Header;
+            return true;
+        }
+
+        symbol -= 257;
+        if (symbol >= 29)
+            return false;
+        size_t length{ length_base[symbol] + bits(length_extra[symbol]) };
+        int code{ decode(m_distances) };
+        if (code < 0 || code >= distance_codes)
+            return false;
+        size_t distance{ distance_base[code] + bits(distance_extra[code]) };
+        if (distance > m_total + m_written)
+            return false;
+        if (distance > m_written || length > m_out_size - m_written)
+        {
+            // Left to inflate(), which fails it if nothing more may be output.
+            m_match_length = length;
+            m_match_distance = distance;
+            return true;
+        }
+
+        // Byte by byte, as a match may overlap itself.
+        uint8_t* dst{ m_out + m_written };
+        const uint8_t* src{ dst - distance };
+        for (size_t i{}; i < length; i++)
+            dst[i] = src[i];
+        m_written += length;
+    }
+}
+
+bool PSDZip::Inflater::stored()
+{
+    const size_t count{ std::min(m_stored_length, m_out_size - m_written) };
+    if ((m_stored_length && !count) || count > m_size - m_position)
+        return false;
+    if (count)
+        std::memcpy(m_out + m_written, m_data + m_position, count);
+    m_position += count;
+    m_written += count;
+    m_stored_length -= count;
+    if (!m_stored_length)
+        m_state = State::Header;
+    return true;
+}
+
+void PSDZip::Inflater::copy_match()
+{
+    const size_t count{ std::min(m_match_length, m_out_size - m_written) };
+    uint8_t* dst{ m_out + m_written };
+    for (size_t i{}; i < count; i++)
+    {
+        // Where the byte comes from, relative to out.
+        const ptrdiff_t from{ static_cast<ptrdiff_t>(m_written + i)
+            - static_cast<ptrdiff_t>(m_match_distance) };
+        dst[i] = from >= 0 ? m_out[from]
+            : m_window[m_window.size() - static_cast<size_t>(-from)];
+    }
+    m_written += count;
+    m_match_length -= count;
+}
+
+void PSDZip::Inflater::refill(int count)
+{
+    while (m_bit_count < count)
+    {
+        uint64_t val{ m_position < m_size ? m_data[m_position] : 0u };
+        if (m_position >= m_size)
+            m_padding += 8;
+        m_position++;
+        m_bit_buffer |= val << m_bit_count;
+        m_bit_count += 8;
+    }
+}
+
+void PSDZip::Inflater::consume(int count)
+{
+    m_bit_buffer >>= count;
+    m_bit_count -= count;
+    if (m_bit_count < m_padding)
+        m_overrun = true;
+}
+
+uint32_t PSDZip::Inflater::bits(int count)
+{
+    if (!count)
+        return 0;
+    refill(count);
+    uint32_t val{ static_cast<uint32_t>(m_bit_buffer
+        & ((uint64_t{ 1 } << count) - 1)) };
+    consume(count);
+    return val;
+}
+
+void PSDZip::Inflater::align()
+{
+    consume(m_bit_count % 8);
+}
+
+std::vector<uint8_t> PSDZip::compress(const uint8_t* data, size_t size,
+    int level)
+{
+    std::vector<uint8_t> out;
+    out.reserve(size / 2 + 64);
+
+    // Header: deflate with a 32KiB window, and the level as zlib reports it.
+    const uint8_t method{ 0x78 };
+    uint8_t flags{ static_cast<uint8_t>(
+        (level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3) << 6) };
+    flags += static_cast<uint8_t>(31 - (method * 256 + flags) % 31);
+    out.push_back(method);
+    out.push_back(flags);
+
+    Deflater deflater{ data, size, level };
+    deflater.run(out);
+
+    uint32_t checksum{ adler32(data, size) };
+    for (int i{ 3 }; i >= 0; i--)
+        out.push_back(static_cast<uint8_t>(checksum >> (8 * i)));
+
+    return out;
+}
+
+bool PSDZip::decompress(const uint8_t* data, size_t size, uint8_t* out,
+    size_t out_size)
+{
+    Inflater inflater{ data, size };
+    return inflater.read(out, out_size) && inflater.finish();
+}
+
+void PSDZip::predict(uint8_t* data, int width, int height)
+{
+    for (int y{}; y < height; y++)
+    {
+        uint8_t* row{ data + static_cast<size_t>(width) * y };
+        for (int x{ width - 1 }; x > 0; x--)
+            row[x] = static_cast<uint8_t>(row[x] - row[x - 1]);
+    }
+}
+
+void PSDZip::unpredict(uint8_t* data, int width, int height)
+{
+    for (int y{}; y < height; y++)
+    {
+        uint8_t* row{ data + static_cast<size_t>(width) * y };
+        for (int x{ 1 }; x < width; x++)
+            row[x] = static_cast<uint8_t>(row[x] + row[x - 1]);
+    }
+}
+
+uint32_t PSDZip::adler32(const uint8_t* data, size_t size, uint32_t adler)
+{
+    // Sums are reduced every 5552 bytes, the most that can't overflow.
+    constexpr uint32_t modulus{ 65521 };
+    uint32_t a{ adler & 0xffff }, b{ adler >> 16 };
+    while (size)
+    {
+        size_t n{ std::min<size_t>(size, 5552) };
+        size -= n;
+        for (size_t i{}; i < n; i++)
+        {
+            a += data[i];
+            b += a;
+        }
+        data += n;
+        a %= modulus;
+        b %= modulus;
+    }
+    return b << 16 | a;
+}
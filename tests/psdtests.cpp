@@ -3,8 +3,19 @@
 // LICENSE file in the root directory of this source tree.
 
 #include "psdocument.hpp"
+#include "psdencoder.hpp"
+#include "psdimage.hpp"
+#include "psdzip.hpp"
 #include <cstdio>
 #include <vector>
+#include <fstream>
+#include <sstream>
+#include <future>
+#include <string>
+#include <iterator>
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
 
 using namespace psdw;
 
@@ -55,6 +66,130 @@ private:
     std::vector<unsigned char> m_image;
 };
 
+std::vector<char> read_file(const std::filesystem::path& filename)
+{
+    std::ifstream file{ filename, std::ios::binary };
+    return { std::istreambuf_iterator<char>(file),
+        std::istreambuf_iterator<char>() };
+}
+
+/* Unpack the merged image at the end of a saved PSD into planes, one 
+channel after another. */
+bool read_merged_image(const std::vector<uint8_t>& file,
+    std::vector<uint8_t>& planes)
+{
+    auto read_be = [&file](size_t offset, size_t size)
+    {
+        uint32_t val{};
+        for (size_t i{}; i < size; i++)
+            val = val << 8 | file[offset + i];
+        return val;
+    };
+    if (file.size() < 26 || read_be(4, 2) != 1)
+        return false;
+    const size_t channels{ read_be(12, 2) };
+    const size_t height{ read_be(14, 4) };
+    const size_t width{ read_be(18, 4) };
+
+    // Skip the colour mode data, image resources, and layer and mask info.
+    size_t offset{ 26 };
+    for (int section{}; section < 3; section++)
+    {
+        if (offset + 4 > file.size())
+            return false;
+        offset += 4 + read_be(offset, 4);
+    }
+    if (offset + 2 > file.size())
+        return false;
+    const uint32_t compression{ read_be(offset, 2) };
+    offset += 2;
+
+    planes.assign(channels * height * width, 0);
+    if (compression == 0)
+    {
+        if (file.size() - offset != planes.size())
+            return false;
+        std::copy(file.begin() + offset, file.end(), planes.begin());
+        return true;
+    }
+    if (compression != 1 || offset + channels * height * 2 > file.size())
+        return false;
+    size_t row_offset{ offset + channels * height * 2 };
+    for (size_t row{}; row < channels * height; row++)
+    {
+        const size_t length{ read_be(offset + row * 2, 2) };
+        if (row_offset + length > file.size()
+            || !psdimpl::PSDCompressedImage::unpack_row(
+                file.data() + row_offset, length, static_cast<int>(width),
+                planes.data() + row * width))
+        {
+            return false;
+        }
+        row_offset += length;
+    }
+    return row_offset == file.size();
+}
+
+// Check a row packed as small as possible unpacks to the same bytes.
+bool rle_round_trips(const std::vector<uint8_t>& row, std::vector<int>& scratch)
+{
+    using psdimpl::PSDCompressedImage;
+    const int width{ static_cast<int>(row.size()) };
+    std::vector<uint8_t> packed(PSDCompressedImage::max_packed_length(width));
+    size_t length{ PSDCompressedImage::pack_row_optimal(row.data(), width,
+        packed.data(), scratch) };
+    if (length > packed.size()
+        || length > PSDCompressedImage::pack_row(row.data(), width,
+            std::vector<uint8_t>(packed.size()).data()))
+    {
+        return false;
+    }
+
+    std::vector<uint8_t> unpacked(row.size());
+    return PSDCompressedImage::unpack_row(packed.data(), length, width,
+        unpacked.data()) && unpacked == row;
+}
+
+/* Deflate a width by height channel at level, optionally after prediction,
+and check it inflates back to the same bytes. block_types gets a bit set for
+the type of the stream's first block: stored, fixed or dynamic. */
+bool zip_round_trips(const std::vector<uint8_t>& channel, int width,
+    int height, int level, bool prediction, unsigned& block_types)
+{
+    std::vector<uint8_t> input{ channel };
+    if (prediction)
+        psdimpl::PSDZip::predict(input.data(), width, height);
+    std::vector<uint8_t> stream{
+        psdimpl::PSDZip::compress(input.data(), input.size(), level) };
+    if (stream.size() < 3)
+        return false;
+    block_types |= 1u << (stream[2] >> 1 & 3);
+
+    std::vector<uint8_t> output(channel.size());
+    if (!psdimpl::PSDZip::decompress(stream.data(), stream.size(),
+        output.data(), output.size()))
+    {
+        return false;
+    }
+
+    // Inflating in uneven pieces should give the same bytes.
+    std::vector<uint8_t> pieces(channel.size());
+    psdimpl::PSDZip::Inflater inflater{ stream.data(), stream.size() };
+    for (size_t offset{}, piece{ 1 }; offset < pieces.size(); piece *= 3)
+    {
+        const size_t size{ std::min(piece, pieces.size() - offset) };
+        if (!inflater.read(pieces.data() + offset, size))
+            return false;
+        offset += size;
+    }
+    if (!inflater.finish() || pieces != output)
+        return false;
+
+    if (prediction)
+        psdimpl::PSDZip::unpredict(output.data(), width, height);
+    return output == channel;
+}
+
 int main()
 {
     PSDocument psd{ 1200, 800, {128, 128, 128} };
@@ -95,6 +230,12 @@ int main()
         return EXIT_FAILURE;
     }
 
+    // Layers are composited together, here or when saving.
+    if (psd.flatten() != PSDStatus::Success)
+    {
+        return EXIT_FAILURE;
+    }
+
     const char filename[]{ "Test.psd" };
     psd.save(filename);
     if (psd.status() != PSDStatus::Success)
@@ -103,7 +244,331 @@ int main()
         return EXIT_FAILURE;
     }
 
+    // A memory-mapped save should produce exactly the same file.
+    const char mapped_filename[]{ "TestMapped.psd" };
+    psd.save(mapped_filename, true, PSDSaveMode::MemoryMapped);
+    if (psd.status() != PSDStatus::Success
+        || read_file(filename) != read_file(mapped_filename))
+    {
+        std::remove(filename);
+        std::remove(mapped_filename);
+        return EXIT_FAILURE;
+    }
+
+    // As should saving to memory.
+    std::vector<uint8_t> buffer;
+    psd.save_to_memory(buffer);
+    const std::vector<char> file{ read_file(filename) };
+    if (psd.status() != PSDStatus::Success
+        || !std::equal(buffer.begin(), buffer.end(), file.begin(), file.end(),
+            [](uint8_t a, char b) { return a == static_cast<uint8_t>(b); }))
+    {
+        std::remove(filename);
+        std::remove(mapped_filename);
+        return EXIT_FAILURE;
+    }
+
+    // And streaming it.
+    std::ostringstream stream;
+    psd.save(stream);
+    if (psd.status() != PSDStatus::Success
+        || stream.str() != std::string(file.begin(), file.end()))
+    {
+        std::remove(filename);
+        std::remove(mapped_filename);
+        return EXIT_FAILURE;
+    }
+
+    // And pulling it through an encoder, in chunks that don't line up with
+    // any section.
+    PSDEncoder encoder{ psd };
+    std::vector<char> pulled;
+    std::vector<unsigned char> chunk(997);
+    while (!encoder.done())
+    {
+        size_t length{ encoder.next_chunk(chunk.data(), chunk.size()) };
+        pulled.insert(pulled.end(), chunk.begin(), chunk.begin() + length);
+    }
+    if (encoder.status() != PSDStatus::Success
+        || encoder.size() != pulled.size()
+        || pulled != file)
+    {
+        std::remove(filename);
+        std::remove(mapped_filename);
+        return EXIT_FAILURE;
+    }
+
+    // The estimate should never be less than the real size.
+    if (psd.estimated_size() < file.size())
+    {
+        std::remove(filename);
+        std::remove(mapped_filename);
+        return EXIT_FAILURE;
+    }
+
+    // Saving in the background should also match, after which the document
+    // can no longer be used.
+    const char async_filename[]{ "TestAsync.psd" };
+    std::future<PSDStatus> result{ psd.save_async(async_filename, true) };
+    if (result.get() != PSDStatus::Success
+        || read_file(async_filename) != file
+        || psd.add_guide(50, PSDOrientation::Vertical)
+            != PSDStatus::InvalidArgument)
+    {
+        std::remove(filename);
+        std::remove(mapped_filename);
+        std::remove(async_filename);
+        return EXIT_FAILURE;
+    }
+
     std::remove(filename);
+    std::remove(mapped_filename);
+    std::remove(async_filename);
+
+    // Documents wider than 30,000 pixels are saved as a PSB (version 2),
+    // unless a PSD is asked for, which can't be done.
+    PSDocument wide{ 30001, 2 };
+    std::vector<uint8_t> wide_buffer;
+    if (wide.save_to_memory(wide_buffer) != PSDStatus::Success
+        || wide_buffer.size() < 6 || wide_buffer[4] != 0 || wide_buffer[5] != 2)
+    {
+        return EXIT_FAILURE;
+    }
+    wide.set_format(PSDFormat::PSD);
+    if (wide.save_to_memory(wide_buffer) != PSDStatus::FileWriteError)
+    {
+        return EXIT_FAILURE;
+    }
+
+    // Auto compression shouldn't let RLE inflate noise.
+    std::vector<unsigned char> noise(100 * 100 * 4);
+    uint32_t seed{ 1 };
+    for (unsigned char& val : noise)
+    {
+        seed = seed * 1664525 + 1013904223;
+        val = static_cast<unsigned char>(seed >> 24);
+    }
+    std::vector<uint8_t> rle_buffer;
+    std::vector<uint8_t> auto_buffer;
+    for (PSDCompression compression : { PSDCompression::RLE, PSDCompression::Auto })
+    {
+        PSDocument noisy{ 100, 100 };
+        noisy.add_layer(noise.data(), { 0, 0, 100, 100 }, "Noise", true,
+            PSDChannelOrder::RGBA, compression);
+        noisy.save_to_memory(compression == PSDCompression::RLE
+            ? rle_buffer : auto_buffer);
+    }
+    if (auto_buffer.empty() || auto_buffer.size() >= rle_buffer.size())
+    {
+        return EXIT_FAILURE;
+    }
+
+    // Short runs are where Photoshop's packing is furthest from optimal.
+    std::vector<unsigned char> runs(400 * 4 * 4);
+    for (size_t i{}; i < runs.size(); i++)
+        runs[i] = static_cast<unsigned char>("aaabbcc"[i / 4 % 400 % 7]);
+    std::vector<uint8_t> optimal_buffer;
+    PSDocument packed{ 400, 4 };
+    packed.add_layer(runs.data(), { 0, 0, 400, 4 }, "Runs", true,
+        PSDChannelOrder::RGBA, PSDCompression::RLE);
+    packed.save_to_memory(rle_buffer);
+    PSDocument optimal{ 400, 4 };
+    optimal.add_layer(runs.data(), { 0, 0, 400, 4 }, "Runs", true,
+        PSDChannelOrder::RGBA, PSDCompression::RLEOptimal);
+    optimal.save_to_memory(optimal_buffer);
+    if (optimal.rle_savings() == 0
+        || optimal_buffer.size() >= rle_buffer.size())
+    {
+        return EXIT_FAILURE;
+    }
+
+    // Optimally packed rows unpack exactly, around the 128 byte limits on
+    // literals and runs, and with short runs where groups meet.
+    std::vector<int> scratch;
+    std::vector<std::vector<uint8_t>> rows;
+    for (int width : { 1, 2, 3, 127, 128, 129, 130, 255, 256, 257 })
+    {
+        rows.push_back(std::vector<uint8_t>(width, 9));
+        std::vector<uint8_t> literal(width);
+        for (int x{}; x < width; x++)
+            literal[x] = static_cast<uint8_t>(x);
+        rows.push_back(literal);
+    }
+    for (int literals : { 1, 125, 126, 127, 128, 129 })
+    {
+        for (int run : { 2, 3 })
+        {
+            // A short run, then more literals, across each group boundary.
+            std::vector<uint8_t> row;
+            for (int x{}; x < literals; x++)
+                row.push_back(static_cast<uint8_t>(x));
+            row.insert(row.end(), run, 200);
+            for (int x{}; x < 130; x++)
+                row.push_back(static_cast<uint8_t>(x));
+            rows.push_back(row);
+            // Or after a long run.
+            row.assign(literals, 7);
+            row.insert(row.end(), run, 200);
+            row.push_back(1);
+            rows.push_back(row);
+        }
+    }
+    for (int i{}; i < 2000; i++)
+    {
+        seed = seed * 1664525 + 1013904223;
+        std::vector<uint8_t> row(1 + seed % 600);
+        // Few values make for many short runs.
+        const uint32_t values{ 2 + (seed >> 16) % 4 };
+        for (uint8_t& val : row)
+        {
+            seed = seed * 1664525 + 1013904223;
+            val = static_cast<uint8_t>((seed >> 24) % values);
+        }
+        rows.push_back(row);
+    }
+    for (const std::vector<uint8_t>& row : rows)
+    {
+        if (!rle_round_trips(row, scratch))
+        {
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Layers hanging off every edge, or missing the canvas entirely, only
+    // composite what overlaps it. Each pixel of the bleed layer holds its
+    // own position, with a transparent stripe showing the background.
+    std::vector<unsigned char> bleed(140 * 90 * 4);
+    for (size_t i{}; i < 140 * 90; i++)
+    {
+        const size_t x{ i % 140 };
+        const size_t y{ i / 140 };
+        bleed[i * 4] = static_cast<unsigned char>(x);
+        bleed[i * 4 + 1] = static_cast<unsigned char>(y);
+        bleed[i * 4 + 2] = 99;
+        bleed[i * 4 + 3] = x >= 60 && x < 80 ? 0 : 255;
+    }
+    const std::vector<unsigned char> red(140 * 90 * 4, 255);
+    PSDocument bled{ 100, 50, { 10, 20, 30 } };
+    bled.add_layer(bleed.data(), { -20, -20, 140, 90 }, "Bleed", true,
+        PSDChannelOrder::RGBA, PSDCompression::RLE);
+    bled.add_layer(red.data(), { -500, 2000, 140, 90 }, "Off canvas", true,
+        PSDChannelOrder::RGBA, PSDCompression::RLE);
+    std::vector<uint8_t> planes;
+    if (bled.status() != PSDStatus::Success
+        || bled.save_to_memory(rle_buffer) != PSDStatus::Success
+        || !read_merged_image(rle_buffer, planes)
+        || planes.size() != 3 * 100 * 50)
+    {
+        return EXIT_FAILURE;
+    }
+    for (size_t y{}; y < 50; y++)
+    {
+        for (size_t x{}; x < 100; x++)
+        {
+            const bool hole{ x + 20 >= 60 && x + 20 < 80 };
+            const uint8_t expected[3]{
+                static_cast<uint8_t>(hole ? 10 : x + 20),
+                static_cast<uint8_t>(hole ? 20 : y + 20),
+                static_cast<uint8_t>(hole ? 30 : 99) };
+            for (size_t c{}; c < 3; c++)
+            {
+                if (planes[(c * 50 + y) * 100 + x] != expected[c])
+                {
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+    }
+
+    // Gradients, which RLE can't shrink, should deflate well after prediction.
+    std::vector<unsigned char> gradient(256 * 64 * 4);
+    for (size_t i{}; i < gradient.size(); i++)
+        gradient[i] = static_cast<unsigned char>(i / 4 % 256);
+    std::vector<uint8_t> zip_buffer;
+    for (PSDCompression compression : { PSDCompression::RLE,
+        PSDCompression::ZIPPrediction })
+    {
+        PSDocument smooth{ 256, 64 };
+        smooth.set_zip_level(9);
+        smooth.add_layer(gradient.data(), { 0, 0, 256, 64 }, "Gradient", true,
+            PSDChannelOrder::RGBA, compression);
+        smooth.save_to_memory(compression == PSDCompression::RLE
+            ? rle_buffer : zip_buffer);
+    }
+    if (zip_buffer.empty() || zip_buffer.size() >= rle_buffer.size())
+    {
+        return EXIT_FAILURE;
+    }
+
+    // Deflated channels, predicted or not, inflate back exactly at every
+    // level, using every kind of block.
+    struct ZipChannel
+    {
+        int width;
+        int height;
+        std::vector<uint8_t> data;
+    };
+    std::vector<ZipChannel> zip_channels{ { 0, 0, {} }, { 1, 1, { 77 } },
+        { 256, 64, {} }, { 300, 40, {} }, { 300, 40, {} } };
+    for (size_t i{}; i < 256 * 64; i++)
+        zip_channels[2].data.push_back(static_cast<uint8_t>(i % 256));
+    for (size_t i{}; i < 300 * 40; i++)
+    {
+        seed = seed * 1664525 + 1013904223;
+        zip_channels[3].data.push_back(static_cast<uint8_t>(seed >> 24));
+        // Noise from a few values, which only dynamic codes suit.
+        zip_channels[4].data.push_back(static_cast<uint8_t>("abcd"[seed >> 30]));
+    }
+    unsigned block_types{};
+    for (const ZipChannel& channel : zip_channels)
+    {
+        for (int level{}; level <= psdimpl::PSDZip::max_level; level++)
+        {
+            for (bool prediction : { false, true })
+            {
+                if (!zip_round_trips(channel.data, channel.width,
+                    channel.height, level, prediction, block_types))
+                {
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+    }
+    if (block_types != 0b111)
+    {
+        return EXIT_FAILURE;
+    }
+
+    // Without maximize compatibility, nothing is composited, and a white
+    // placeholder is saved with the Version Info resource saying so.
+    std::vector<uint8_t> compatible_buffer;
+    std::vector<uint8_t> placeholder_buffer;
+    for (bool maximize : { true, false })
+    {
+        PSDocument layered{ 300, 200, { 10, 20, 30 } };
+        layered.set_maximize_compatibility(maximize);
+        layered.add_layer(noise.data(), { 50, 50, 100, 100 }, "Noise", true,
+            PSDChannelOrder::RGBA, PSDCompression::RLE);
+        layered.save_to_memory(maximize
+            ? compatible_buffer : placeholder_buffer);
+    }
+    const std::vector<uint8_t> version_info{ '8', 'B', 'I', 'M', 0x04, 0x21 };
+    const auto resource{ std::search(placeholder_buffer.begin(),
+        placeholder_buffer.end(), version_info.begin(), version_info.end()) };
+    // After the ID come an empty name, the length and the version.
+    const size_t has_real_merged_data{ 6 + 2 + 4 + 4 };
+    if (placeholder_buffer.empty()
+        || placeholder_buffer.size() >= compatible_buffer.size()
+        || placeholder_buffer.end() - resource
+            <= static_cast<ptrdiff_t>(has_real_merged_data)
+        || resource[has_real_merged_data] != 0
+        || !read_merged_image(placeholder_buffer, planes)
+        || planes.size() != 3 * 300 * 200
+        || std::any_of(planes.begin(), planes.end(),
+            [](uint8_t val) { return val != 255; }))
+    {
+        return EXIT_FAILURE;
+    }
 
     return EXIT_SUCCESS;
 }